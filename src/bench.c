@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the primitives on the relay hot path: the net.c
+ * read/write codec, the game classifier, client lookup by address and by ip
+ * for the p2p port rule, and broadcast recipient selection. Lookups and
+ * broadcasts run against a registry of 10, 1k, 10k and 100k clients.
+ *
+ * Linked with --wrap for the allocator so every result also says how many
+ * heap allocations an operation costs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "net.h"
+#include "timer.h"
+#include "rate.h"
+#include "relay.h"
+
+#define BENCH_INDICES   65536
+
+static uint64_t allocs;
+static volatile uint32_t sink;
+static uint32_t rng = 2463534242u;
+static uint32_t indices[BENCH_INDICES];
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+/* the relay logs through log.c, not wanted here */
+int log_printf(const char *fmt, ...)
+{
+    return 0;
+}
+
+int log_statusf(const char *fmt, ...)
+{
+    return 0;
+}
+
+void log_status_clear()
+{
+}
+
+static uint64_t emitted;
+
+static void bench_send(const void *buf, size_t len, struct sockaddr_in *dst)
+{
+    emitted++;
+}
+
+static void bench_flush()
+{
+}
+
+static RelayIO bench_io = { bench_send, bench_flush };
+
+static uint32_t bench_rand()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static uint64_t bench_start;
+static uint64_t bench_allocs;
+
+static void start()
+{
+    bench_allocs = allocs;
+    bench_start = timer_now_us();
+}
+
+static void stop(const char *name, int clients, uint64_t ops)
+{
+    uint64_t us = timer_now_us() - bench_start;
+
+    if (clients > 0)
+    {
+        printf("%-24s %8d %10.1f %10.2f\n", name, clients, us * 1000.0 / ops, (double)(allocs - bench_allocs) / ops);
+    }
+    else
+    {
+        printf("%-24s %8s %10.1f %10.2f\n", name, "-", us * 1000.0 / ops, (double)(allocs - bench_allocs) / ops);
+    }
+}
+
+static void bench_codec(uint64_t ops)
+{
+    static uint8_t buf[NET_BUF_SIZE];
+    char str[64];
+    uint64_t i, j;
+
+    for (i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = i;
+    }
+
+    /* reads go over a 1 kB datagram and start over */
+    start();
+    for (i = 0; i < ops; i += 1024)
+    {
+        net_recv_set(buf, 1024);
+        for (j = 0; j < 1024; j++)
+        {
+            sink += net_read_int8();
+        }
+    }
+    stop("net_read_int8", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 512)
+    {
+        net_recv_set(buf, 1024);
+        for (j = 0; j < 512; j++)
+        {
+            sink += net_read_int16();
+        }
+    }
+    stop("net_read_int16", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 256)
+    {
+        net_recv_set(buf, 1024);
+        for (j = 0; j < 256; j++)
+        {
+            sink += net_read_int32();
+        }
+    }
+    stop("net_read_int32", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 32)
+    {
+        net_recv_set(buf, 1024);
+        for (j = 0; j < 32; j++)
+        {
+            net_read_data(str, 32);
+            sink += str[0];
+        }
+    }
+    stop("net_read_data(32)", 0, i);
+
+    /* the strings of a query reply */
+    for (i = 0; i + 9 <= 1024; i += 9)
+    {
+        memcpy(buf + i, "hostname", 9);
+    }
+
+    start();
+    for (i = 0; i < ops; i += 113)
+    {
+        net_recv_set(buf, 1024);
+        for (j = 0; j < 113; j++)
+        {
+            net_read_string(str, sizeof(str));
+            sink += str[0];
+        }
+    }
+    stop("net_read_string", 0, i);
+
+    /* writes fill the output buffer and discard it */
+    start();
+    for (i = 0; i < ops; i += 1024)
+    {
+        net_send_discard();
+        for (j = 0; j < 1024; j++)
+        {
+            net_write_int8(j);
+        }
+    }
+    stop("net_write_int8", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 512)
+    {
+        net_send_discard();
+        for (j = 0; j < 512; j++)
+        {
+            net_write_int16(j);
+        }
+    }
+    stop("net_write_int16", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 256)
+    {
+        net_send_discard();
+        for (j = 0; j < 256; j++)
+        {
+            net_write_int32(j);
+        }
+    }
+    stop("net_write_int32", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 32)
+    {
+        net_send_discard();
+        for (j = 0; j < 32; j++)
+        {
+            net_write_data(buf, 32);
+        }
+    }
+    stop("net_write_data(32)", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 113)
+    {
+        net_send_discard();
+        for (j = 0; j < 113; j++)
+        {
+            net_write_string("hostname");
+        }
+    }
+    stop("net_write_string", 0, i);
+
+    start();
+    for (i = 0; i < ops; i += 128)
+    {
+        net_send_discard();
+        for (j = 0; j < 128; j++)
+        {
+            net_write_string_int32(12345);
+        }
+    }
+    stop("net_write_string_int32", 0, i);
+
+    net_send_discard();
+}
+
+static void bench_classify(uint64_t ops)
+{
+    static const uint8_t payloads[8][8] = {
+        { 0x34, 0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x35, 0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00, 0x35, 0x12, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00, 0x35, 0x13, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00, 0x35, 0x14, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00, 0x36, 0x12, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF },
+    };
+    uint64_t i;
+
+    start();
+    for (i = 0; i < ops; i++)
+    {
+        sink += relay_classify(payloads[indices[i & (BENCH_INDICES - 1)] & 7], 8);
+    }
+    stop("relay_classify", 0, ops);
+}
+
+static uint32_t client_ip(int i)
+{
+    return htonl(0x0A000000 + i + 1);
+}
+
+/* every fifth client is p2p behind a nat, so its real port is not 8054 */
+static uint16_t client_port(int i)
+{
+    return htons(1024 + (i % 60000));
+}
+
+static void inject(uint32_t ip, uint16_t port, uint8_t *pkt, size_t len)
+{
+    struct sockaddr_in peer;
+
+    net_address_ex(&peer, ip, 0);
+    peer.sin_port = port;
+    net_recv_set(pkt, len);
+    relay_packet(&peer, len, 1000);
+}
+
+static void bench_clients(int n, uint64_t ops)
+{
+    static const uint8_t magic[6][6] = {
+        { 0x34, 0x12, 0x00, 0x00, 0x00, 0x00 },
+        { 0x35, 0x12, 0x00, 0x00, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00, 0x35, 0x12 },
+        { 0x00, 0x00, 0x00, 0x00, 0x35, 0x13 },
+        { 0x00, 0x00, 0x00, 0x00, 0x35, 0x14 },
+        { 0x00, 0x00, 0x00, 0x00, 0x36, 0x12 },
+    };
+    uint8_t pkt[7 + 32];
+    uint64_t i, count;
+    int p2p = (n + 4) / 5;
+
+    relay_init("Bench", 3600, 0, &bench_io, 0);
+
+    /* clients join the six games round robin with a broadcast each */
+    memset(pkt, 0xFF, 7);
+    memset(pkt + 7, 0xAA, 32);
+
+    for (i = 0; i < n; i++)
+    {
+        pkt[0] = (i % 5) == 0 ? CMD_P2P : CMD_TUNNEL;
+        memcpy(pkt + 7, magic[i % 6], 6);
+        inject(client_ip(i), client_port(i), pkt, sizeof(pkt));
+    }
+
+    start();
+    for (i = 0; i < ops; i++)
+    {
+        uint32_t c = indices[i & (BENCH_INDICES - 1)] % n;
+        sink += relay_find(client_ip(c), client_port(c));
+    }
+    stop("lookup (ip, port)", n, ops);
+
+    start();
+    for (i = 0; i < ops; i++)
+    {
+        uint32_t c = (indices[i & (BENCH_INDICES - 1)] % p2p) * 5;
+        sink += relay_find(client_ip(c), htons(8054));
+    }
+    stop("lookup (ip, 8054)", n, ops);
+
+    start();
+    for (i = 0; i < ops; i++)
+    {
+        uint32_t c = indices[i & (BENCH_INDICES - 1)] % n;
+        sink += relay_find(client_ip(c + n), client_port(c));
+    }
+    stop("lookup miss", n, ops);
+
+    /* one broadcast reaches a sixth of the clients, keep the copies made comparable between sizes */
+    count = ops / (n / 6 + 1) + 1;
+    emitted = 0;
+
+    start();
+    for (i = 0; i < count; i++)
+    {
+        uint32_t c = indices[i & (BENCH_INDICES - 1)] % n;
+
+        memset(pkt + 1, 0xFF, 6);
+        pkt[0] = (c % 5) == 0 ? CMD_P2P : CMD_TUNNEL;
+        memcpy(pkt + 7, magic[c % 6], 6);
+        inject(client_ip(c), client_port(c), pkt, sizeof(pkt));
+    }
+    stop("broadcast", n, count);
+
+    printf("%-24s %8d %10.1f\n", "  per recipient", n, emitted ? (timer_now_us() - bench_start) * 1000.0 / emitted : 0.0);
+
+    relay_free();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t ops = 10000000;
+    int i;
+
+    if (argc > 1)
+    {
+        ops = strtoull(argv[1], NULL, 10);
+        if (ops < BENCH_INDICES)
+        {
+            ops = BENCH_INDICES;
+        }
+    }
+
+    for (i = 0; i < BENCH_INDICES; i++)
+    {
+        indices[i] = bench_rand();
+    }
+
+    printf("%-24s %8s %10s %10s\n", "benchmark", "clients", "ns/op", "allocs/op");
+
+    bench_codec(ops);
+    bench_classify(ops);
+
+    bench_clients(10, ops / 10);
+    bench_clients(1000, ops / 10);
+    bench_clients(10000, ops / 10);
+    bench_clients(100000, ops / 10);
+
+    return 0;
+}
@@ -0,0 +1,671 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "net.h"
+#include "log.h"
+#include "hash.h"
+#include "rate.h"
+#include "relay.h"
+#include "cluster.h"
+
+#ifndef WIN32
+    #include <fcntl.h>
+#endif
+
+#define CLUSTER_MAGIC       0xC4C4
+#define CLUSTER_VERSION     1
+#define CLUSTER_HEADER      7
+/* records are packed up to this size, a single larger packet still goes alone */
+#define CLUSTER_MTU         1400
+#define CLUSTER_DATAGRAM    (CLUSTER_MTU + NET_BUF_SIZE)
+/* every node sends all of its clients this often, what isn't heard of in three rounds is gone */
+#define CLUSTER_SYNC        5000
+#define CLUSTER_EXPIRE      (CLUSTER_SYNC * 3)
+
+enum
+{
+    REC_JOIN = 1,
+    REC_LEAVE,
+    REC_DIRECT,
+    REC_BROADCAST
+};
+
+typedef struct ClusterNode
+{
+    struct sockaddr_in  addr;
+    uint32_t            epoch;
+    int32_t             games[GAME_LAST];   /* clients by game, a broadcast only goes where it has recipients */
+    uint8_t             buf[CLUSTER_DATAGRAM];
+    uint32_t            len;
+} ClusterNode;
+
+typedef struct Remote
+{
+    struct sockaddr_in  addr;
+    uint8_t             node;
+    uint8_t             game;
+    uint8_t             p2p;
+    uint64_t            seen;
+} Remote;
+
+ClusterStats cluster_stats;
+
+static int cluster_fd = -1;
+static uint32_t cluster_epoch;
+static ClusterNode *nodes;
+static int num_nodes;
+static Hash remotes;            /* by ip and port */
+static Hash remotes_p2p;        /* p2p clients by ip, for the fake port */
+static uint64_t last_sync;
+static uint8_t rbuf[CLUSTER_DATAGRAM];
+
+static uint64_t cluster_key(uint32_t ip, uint16_t port)
+{
+    return ((uint64_t)ip << 16) | port;
+}
+
+static void node_send(ClusterNode *node)
+{
+    if (node->len > CLUSTER_HEADER)
+    {
+        sendto(cluster_fd, (const char *)node->buf, node->len, 0, (struct sockaddr *)&node->addr, sizeof(struct sockaddr_in));
+        cluster_stats.datagrams_out++;
+    }
+
+    node->len = CLUSTER_HEADER;
+}
+
+/* room for a record, sending what was packed so far when it doesn't fit */
+static uint8_t *node_reserve(ClusterNode *node, uint32_t len)
+{
+    uint8_t *p;
+
+    if (node->len + len > CLUSTER_MTU && node->len > CLUSTER_HEADER)
+    {
+        node_send(node);
+    }
+
+    if (node->len + len > CLUSTER_DATAGRAM)
+    {
+        return NULL;
+    }
+
+    p = node->buf + node->len;
+    node->len += len;
+    return p;
+}
+
+static void node_join(ClusterNode *node, struct sockaddr_in *addr, int game, int p2p)
+{
+    uint8_t *p = node_reserve(node, 9);
+
+    p[0] = REC_JOIN;
+    memcpy(p + 1, &addr->sin_addr.s_addr, 4);
+    memcpy(p + 5, &addr->sin_port, 2);
+    p[7] = game;
+    p[8] = p2p;
+    cluster_stats.updates_out++;
+}
+
+static void node_leave(ClusterNode *node, struct sockaddr_in *addr)
+{
+    uint8_t *p = node_reserve(node, 7);
+
+    p[0] = REC_LEAVE;
+    memcpy(p + 1, &addr->sin_addr.s_addr, 4);
+    memcpy(p + 5, &addr->sin_port, 2);
+    cluster_stats.updates_out++;
+}
+
+static void remote_del(Remote *r)
+{
+    Remote *p2p;
+
+    hash_remove(&remotes, cluster_key(r->addr.sin_addr.s_addr, r->addr.sin_port));
+
+    p2p = hash_get(&remotes_p2p, r->addr.sin_addr.s_addr);
+    if (p2p == r)
+    {
+        hash_remove(&remotes_p2p, r->addr.sin_addr.s_addr);
+    }
+
+    nodes[r->node].games[r->game]--;
+    cluster_stats.remote_clients--;
+    free(r);
+}
+
+static void remote_put(int node, struct sockaddr_in *addr, int game, int p2p, uint64_t now)
+{
+    Remote *r = hash_get(&remotes, cluster_key(addr->sin_addr.s_addr, addr->sin_port));
+
+    if (game < 0 || game >= GAME_LAST)
+    {
+        game = GAME_UNKNOWN;
+    }
+
+    if (r == NULL)
+    {
+        r = calloc(1, sizeof(Remote));
+        r->addr = *addr;
+        r->node = node;
+        r->game = game;
+        hash_put(&remotes, cluster_key(addr->sin_addr.s_addr, addr->sin_port), r);
+        nodes[node].games[game]++;
+        cluster_stats.remote_clients++;
+        relay_reachable(addr);
+    }
+    else if (r->node != node || r->game != game)
+    {
+        /* moved to another node or switched games */
+        nodes[r->node].games[r->game]--;
+        r->node = node;
+        r->game = game;
+        nodes[node].games[game]++;
+    }
+
+    if (p2p && !r->p2p)
+    {
+        relay_reachable(addr);
+    }
+
+    if (r->p2p && !p2p && hash_get(&remotes_p2p, addr->sin_addr.s_addr) == r)
+    {
+        hash_remove(&remotes_p2p, addr->sin_addr.s_addr);
+    }
+
+    r->p2p = p2p;
+    r->seen = now;
+
+    if (p2p)
+    {
+        hash_put(&remotes_p2p, addr->sin_addr.s_addr, r);
+    }
+}
+
+/* everything known about a node, it restarted or went away */
+static void remote_forget(int node)
+{
+    Remote *gone[256];
+    int i, count;
+
+    do
+    {
+        count = 0;
+
+        for (i = 0; i <= remotes.mask && count < 256; i++)
+        {
+            Remote *r = remotes.entries[i].value;
+
+            if (r && r->node == node)
+            {
+                gone[count++] = r;
+            }
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            remote_del(gone[i]);
+        }
+    } while (count == 256);
+}
+
+static void remote_expire(uint64_t now)
+{
+    Remote *gone[256];
+    int i, count;
+
+    do
+    {
+        count = 0;
+
+        for (i = 0; i <= remotes.mask && count < 256; i++)
+        {
+            Remote *r = remotes.entries[i].value;
+
+            if (r && now - r->seen > CLUSTER_EXPIRE)
+            {
+                gone[count++] = r;
+            }
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            remote_del(gone[i]);
+        }
+    } while (count == 256);
+}
+
+/* RelayCluster hooks, called by the relay for its own clients */
+static void cluster_update(struct sockaddr_in *addr, int game, int p2p)
+{
+    int i;
+
+    for (i = 0; i < num_nodes; i++)
+    {
+        if (game < 0)
+        {
+            node_leave(&nodes[i], addr);
+        }
+        else
+        {
+            node_join(&nodes[i], addr, game, p2p);
+        }
+    }
+}
+
+static int cluster_route(const void *buf, size_t len, uint32_t ip, uint16_t port)
+{
+    Remote *r = hash_get(&remotes, cluster_key(ip, port));
+    uint8_t *p;
+    uint16_t plen = len;
+
+    /* hack: same as locally, a p2p client is reachable by its ip and the fake port */
+    if (r == NULL && ntohs(port) == 8054)
+    {
+        r = hash_get(&remotes_p2p, ip);
+    }
+
+    if (r == NULL || len > NET_BUF_SIZE)
+    {
+        return 0;
+    }
+
+    p = node_reserve(&nodes[r->node], 9 + len);
+    if (p == NULL)
+    {
+        return 0;
+    }
+
+    p[0] = REC_DIRECT;
+    memcpy(p + 1, &r->addr.sin_addr.s_addr, 4);
+    memcpy(p + 5, &r->addr.sin_port, 2);
+    memcpy(p + 7, &plen, 2);
+    memcpy(p + 9, buf, len);
+    cluster_stats.forwarded_out++;
+    return 1;
+}
+
+static void cluster_broadcast(const void *buf, size_t len, int game)
+{
+    uint16_t plen = len;
+    int i;
+
+    if (len > NET_BUF_SIZE)
+    {
+        return;
+    }
+
+    for (i = 0; i < num_nodes; i++)
+    {
+        ClusterNode *node = &nodes[i];
+        uint8_t *p;
+
+        /* the unknown group of every node gets all broadcasts, like locally */
+        if (node->games[game] == 0 && node->games[GAME_UNKNOWN] == 0)
+        {
+            continue;
+        }
+
+        p = node_reserve(node, 4 + len);
+        if (p == NULL)
+        {
+            continue;
+        }
+
+        p[0] = REC_BROADCAST;
+        p[1] = game;
+        memcpy(p + 2, &plen, 2);
+        memcpy(p + 4, buf, len);
+        cluster_stats.forwarded_out++;
+    }
+}
+
+static RelayCluster cluster_hooks = { cluster_update, cluster_route, cluster_broadcast };
+
+static void cluster_header(ClusterNode *node)
+{
+    uint16_t magic = htons(CLUSTER_MAGIC);
+    uint32_t epoch = htonl(cluster_epoch);
+
+    memcpy(node->buf, &magic, 2);
+    node->buf[2] = CLUSTER_VERSION;
+    memcpy(node->buf + 3, &epoch, 4);
+    node->len = CLUSTER_HEADER;
+}
+
+int cluster_open(const char *ip, int port, const char *peers, uint64_t now)
+{
+    struct sockaddr_in addr;
+    char list[1024], *tok;
+    int i, yes = 1;
+
+    memset(&cluster_stats, 0, sizeof(cluster_stats));
+
+    nodes = calloc(CLUSTER_NODES, sizeof(ClusterNode));
+    num_nodes = 0;
+
+    strncpy(list, peers, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+
+    for (tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+    {
+        char *colon = strchr(tok, ':');
+
+        if (colon == NULL || num_nodes == CLUSTER_NODES)
+        {
+            fprintf(stderr, "Ignoring cluster node %s\n", tok);
+            continue;
+        }
+
+        *colon = '\0';
+
+        if (!net_address(&nodes[num_nodes].addr, tok, atoi(colon + 1)))
+        {
+            fprintf(stderr, "Failed to resolve cluster node %s\n", tok);
+            continue;
+        }
+
+        num_nodes++;
+    }
+
+    cluster_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (cluster_fd < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(cluster_fd, SOL_SOCKET, SO_REUSEADDR, (char *) &yes, sizeof(yes));
+    net_address(&addr, ip, port);
+
+    if (bind(cluster_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(cluster_fd);
+        cluster_fd = -1;
+        return -1;
+    }
+
+#ifndef WIN32
+    fcntl(cluster_fd, F_SETFL, fcntl(cluster_fd, F_GETFL) | O_NONBLOCK);
+#endif
+
+    /* different for every run, the others drop what they knew about the last one */
+    cluster_epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ (uint32_t)now;
+
+    hash_init(&remotes);
+    hash_init(&remotes_p2p);
+
+    for (i = 0; i < num_nodes; i++)
+    {
+        cluster_header(&nodes[i]);
+    }
+
+    /* the first sync goes out right away */
+    last_sync = now - CLUSTER_SYNC;
+    cluster_stats.nodes = num_nodes;
+
+    relay_cluster(&cluster_hooks);
+    return cluster_fd;
+}
+
+static int cluster_node(struct sockaddr_in *from)
+{
+    int i;
+
+    for (i = 0; i < num_nodes; i++)
+    {
+        if (nodes[i].addr.sin_addr.s_addr == from->sin_addr.s_addr && nodes[i].addr.sin_port == from->sin_port)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void cluster_datagram(int node, uint8_t *buf, uint32_t len, uint64_t now)
+{
+    struct sockaddr_in addr;
+    uint32_t pos = CLUSTER_HEADER;
+    uint32_t epoch;
+    uint16_t magic, plen;
+
+    memcpy(&magic, buf, 2);
+    if (len < CLUSTER_HEADER || ntohs(magic) != CLUSTER_MAGIC || buf[2] != CLUSTER_VERSION)
+    {
+        return;
+    }
+
+    memcpy(&epoch, buf + 3, 4);
+    epoch = ntohl(epoch);
+
+    if (epoch != nodes[node].epoch)
+    {
+        if (nodes[node].epoch)
+        {
+            log_printf("Cluster node %s:%d restarted\n", inet_ntoa(nodes[node].addr.sin_addr), ntohs(nodes[node].addr.sin_port));
+        }
+
+        remote_forget(node);
+        nodes[node].epoch = epoch;
+    }
+
+    cluster_stats.datagrams_in++;
+
+    while (pos < len)
+    {
+        uint8_t type = buf[pos];
+
+        switch (type)
+        {
+            case REC_JOIN:
+                if (pos + 9 > len)
+                {
+                    return;
+                }
+                net_address_ex(&addr, 0, 0);
+                memcpy(&addr.sin_addr.s_addr, buf + pos + 1, 4);
+                memcpy(&addr.sin_port, buf + pos + 5, 2);
+                remote_put(node, &addr, buf[pos + 7], buf[pos + 8], now);
+                cluster_stats.updates_in++;
+                pos += 9;
+                break;
+
+            case REC_LEAVE:
+                if (pos + 7 > len)
+                {
+                    return;
+                }
+                {
+                    uint32_t ip;
+                    uint16_t port;
+                    Remote *r;
+
+                    memcpy(&ip, buf + pos + 1, 4);
+                    memcpy(&port, buf + pos + 5, 2);
+                    r = hash_get(&remotes, cluster_key(ip, port));
+
+                    /* it may have reconnected to another node meanwhile */
+                    if (r && r->node == node)
+                    {
+                        remote_del(r);
+                    }
+                }
+                cluster_stats.updates_in++;
+                pos += 7;
+                break;
+
+            case REC_DIRECT:
+                if (pos + 9 > len)
+                {
+                    return;
+                }
+                {
+                    uint32_t ip;
+                    uint16_t port;
+
+                    memcpy(&ip, buf + pos + 1, 4);
+                    memcpy(&port, buf + pos + 5, 2);
+                    memcpy(&plen, buf + pos + 7, 2);
+
+                    if (pos + 9 + plen > len)
+                    {
+                        return;
+                    }
+
+                    /* nothing a client sent us can be bigger, the source address is all that vouches for a node */
+                    if (plen <= NET_BUF_SIZE)
+                    {
+                        relay_deliver(buf + pos + 9, plen, ip, port);
+                        cluster_stats.forwarded_in++;
+                    }
+
+                    pos += 9 + plen;
+                }
+                break;
+
+            case REC_BROADCAST:
+                if (pos + 4 > len)
+                {
+                    return;
+                }
+                memcpy(&plen, buf + pos + 2, 2);
+
+                if (pos + 4 + plen > len)
+                {
+                    return;
+                }
+
+                if (plen <= NET_BUF_SIZE)
+                {
+                    relay_fanout(buf + pos + 4, plen, buf[pos + 1]);
+                    cluster_stats.forwarded_in++;
+                }
+
+                pos += 4 + plen;
+                break;
+
+            default:
+                /* a newer version, the rest can't be parsed */
+                return;
+        }
+    }
+}
+
+void cluster_recv(uint64_t now)
+{
+    struct sockaddr_in from;
+    socklen_t l;
+    int len, node;
+
+    if (cluster_fd < 0)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        l = sizeof(from);
+        len = recvfrom(cluster_fd, (char *)rbuf, sizeof(rbuf), 0, (struct sockaddr *)&from, &l);
+
+        if (len < 0)
+        {
+            break;
+        }
+
+        /* only configured nodes may tell where clients are */
+        node = cluster_node(&from);
+        if (node < 0)
+        {
+            continue;
+        }
+
+        cluster_datagram(node, rbuf, len, now);
+
+        /* packets relayed from it are queued in place, they have to go before rbuf is read into again */
+        net_flush();
+    }
+}
+
+static void cluster_sync_client(struct sockaddr_in *addr, int game, int p2p)
+{
+    cluster_update(addr, game, p2p);
+}
+
+void cluster_flush(uint64_t now)
+{
+    int i;
+
+    if (cluster_fd < 0)
+    {
+        return;
+    }
+
+    if (now - last_sync >= CLUSTER_SYNC)
+    {
+        relay_each(cluster_sync_client);
+        remote_expire(now);
+
+        /* an empty node still lets the others know its epoch */
+        for (i = 0; i < num_nodes; i++)
+        {
+            if (nodes[i].len == CLUSTER_HEADER)
+            {
+                sendto(cluster_fd, (const char *)nodes[i].buf, CLUSTER_HEADER, 0, (struct sockaddr *)&nodes[i].addr, sizeof(struct sockaddr_in));
+                cluster_stats.datagrams_out++;
+            }
+        }
+
+        last_sync = now;
+    }
+
+    for (i = 0; i < num_nodes; i++)
+    {
+        node_send(&nodes[i]);
+    }
+}
+
+void cluster_close()
+{
+    Remote *r;
+    int i;
+
+    if (cluster_fd < 0)
+    {
+        return;
+    }
+
+    relay_cluster(NULL);
+
+    for (i = 0; i <= remotes.mask; i++)
+    {
+        r = remotes.entries[i].value;
+        free(r);
+    }
+
+    hash_free(&remotes);
+    hash_free(&remotes_p2p);
+    free(nodes);
+    nodes = NULL;
+    num_nodes = 0;
+
+    close(cluster_fd);
+    cluster_fd = -1;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Relays sharing their clients, every node tells the others over its own
+ * UDP socket who connected, left or changed games and relays packets to
+ * clients of other nodes through the node that has them. Include net.h first.
+ *
+ * Datagrams between nodes are a header followed by as many records as fit:
+ *
+ *   header     magic(2) version(1) epoch(4)
+ *   join       1 ip(4) port(2) game(1) p2p(1)
+ *   leave      2 ip(4) port(2)
+ *   direct     3 ip(4) port(2) len(2) packet
+ *   broadcast  4 game(1) len(2) packet
+ *
+ * Addresses are in network byte order, lengths in host byte order. The
+ * epoch changes every time a node starts so the others forget what they
+ * knew about its previous run, and every node sends all of its clients
+ * again periodically so a lost update heals itself.
+ */
+
+#define CLUSTER_NODES   32
+
+typedef struct ClusterStats
+{
+    uint64_t            datagrams_in;
+    uint64_t            datagrams_out;
+    uint64_t            forwarded_in;       /* packets other nodes relayed through us */
+    uint64_t            forwarded_out;
+    uint64_t            updates_in;
+    uint64_t            updates_out;
+    uint32_t            nodes;
+    uint32_t            remote_clients;
+} ClusterStats;
+
+extern ClusterStats cluster_stats;
+
+/* peers is a comma separated list of ip:port of the other nodes, returns the socket to wait on */
+int cluster_open(const char *ip, int port, const char *peers, uint64_t now);
+void cluster_recv(uint64_t now);
+void cluster_flush(uint64_t now);
+void cluster_close();
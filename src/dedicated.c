@@ -14,73 +14,439 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+    /* pthread_setaffinity_np(3) */
+    #define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <signal.h>
+#ifndef WIN32
+    #include <pthread.h>
+#endif
 #include "net.h"
 #include "log.h"
-#include "list.h"
+#include "timer.h"
+#include "metrics.h"
+#include "rate.h"
+#include "relay.h"
+#include "cluster.h"
+#include "handoff.h"
+#include "snapshot.h"
 
 /* mingw supports it and I really want getopt(3) */
 #include <unistd.h>
 #include <stdlib.h>
 
-enum
+typedef struct Config
+{
+    int32_t             port;
+    char                ip[32];
+    char                hostname[256];
+    int32_t             timeout;
+    int32_t             maxclients;
+    int32_t             batch;
+    int32_t             workers;
+    int32_t             metrics;
+    char                capture[256];
+    int32_t             rate[RATE_LAST];
+    int32_t             uring;
+    int32_t             cluster;
+    char                nodes[1024];
+    char                handoff[108];
+    char                snapshot[256];
+    char                signatures[256];
+    int32_t             spin;
+    int32_t             cpu;
+    int32_t             fifo;
+    int32_t             probe;
+} Config;
+
+/* where the time of a worker goes, spinning on an empty socket, blocked in the kernel or relaying */
+typedef struct LoopStats
 {
-    GAME_UNKNOWN,
-    GAME_CNC95,
-    GAME_RA95,
-    GAME_TS,
-    GAME_TSDTA,
-    GAME_TSTI,
-    GAME_RA2,
-    GAME_LAST
-};
-
-const char *game_str(int game)
+    uint64_t            spin_us;
+    uint64_t            block_us;
+    uint64_t            relay_us;
+    uint64_t            spin_wakeups;       /* work found while spinning */
+    uint64_t            block_wakeups;      /* work found after blocking */
+    uint64_t            window_us;          /* how long the worker spins right now */
+    uint64_t            pad[2];             /* a cache line each */
+} LoopStats;
+
+/* the spin window never shrinks below this, it is what a single empty poll roughly costs */
+#define SPIN_MIN_US 5
+
+static Config config;
+static uint64_t booted;
+static int metrics_fd = -1;
+static int cluster_fd = -1;
+static int handoff_fd = -1;
+static LoopStats loop_stats[64] __attribute__((aligned(64)));
+/* the relay socket of each worker, the ones a handoff gave us are adopted instead of bound */
+static int worker_socks[64];
+static int workers_running;
+/* set while worker 0 hands over, the others stop reading and wait for it to be done */
+static int handoff_parking;
+static int handoff_parked;
+
+/* workers share the client registry, most packets only read it and are relayed side by side, it is taken
+ * exclusively per packet that changes it and never held over I/O. Writers go first so a busy relay
+ * doesn't hold off timeouts */
+#ifndef WIN32
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t relay_rwlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t relay_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+static pthread_t *workers;
+#endif
+
+static void relay_lock()
 {
-    switch (game)
+#ifndef WIN32
+    if (config.workers > 1)
     {
-        case GAME_CNC95:    return "C&C95";
-        case GAME_RA95:     return "RA95";
-        case GAME_TS:       return "TS";
-        case GAME_TSDTA:    return "TSDTA";
-        case GAME_TSTI:     return "TSTI";
-        case GAME_RA2:      return "RA2";
-        default:            return "UNKNOWN";
+        pthread_rwlock_wrlock(&relay_rwlock);
     }
+#endif
 }
 
-enum
+static void relay_read_lock()
 {
-    CMD_TUNNEL,     /* 0 */
-    CMD_P2P,        /* 1 */
-    CMD_DISCONNECT, /* 2 */
-    CMD_PING,       /* 3 */
-    CMD_QUERY,      /* 4 */
-    CMD_TESTP2P     /* 5 */
-};
-
-typedef struct Client
+#ifndef WIN32
+    if (config.workers > 1)
+    {
+        pthread_rwlock_rdlock(&relay_rwlock);
+    }
+#endif
+}
+
+static void relay_unlock()
 {
-    struct sockaddr_in  addr;
-    uint8_t             p2p;
-    uint32_t            last_packet;
-    uint32_t            last_ping;
-    uint32_t            ping_count;
-    uint8_t             game;
-    struct Client       *next;
-} Client;
+#ifndef WIN32
+    if (config.workers > 1)
+    {
+        pthread_rwlock_unlock(&relay_rwlock);
+    }
+#endif
+}
 
-typedef struct Config
+static void relay_status(uint64_t now_ms)
 {
-    int32_t             port;
-    char                ip[32];
-    char                hostname[256];
-    int32_t             timeout;
-    int32_t             maxclients;
-} Config;
+    uint32_t now = now_ms / 1000;
+    static uint64_t last_packets = 0;
+    static uint64_t last_bytes = 0;
+    static uint32_t last_time = 0;
+    uint64_t total_packets;
+    uint32_t bps, pps;
+    int stat_elapsed;
+
+    relay_stats_collect();
+    total_packets = relay_stats.packets_in + relay_stats.packets_out;
+
+    if (now <= last_time)
+    {
+        return;
+    }
+
+    stat_elapsed = now - last_time;
+    pps = (total_packets - last_packets) / stat_elapsed;
+    bps = (relay_stats.bytes_in - last_bytes) / stat_elapsed;
+    last_packets = total_packets;
+    last_bytes = relay_stats.bytes_in;
+    last_time = now;
+
+    log_statusf("%s [ %d/%d | %d p/s, %d kB/s | total: %llu p, %llu kB ]",
+        config.hostname, relay_clients(-1), config.maxclients, pps, bps / 1024,
+        (unsigned long long)total_packets, (unsigned long long)(relay_stats.bytes_in / 1024));
+}
+
+static size_t stats_render(char *buf, size_t size, uint64_t now)
+{
+    size_t pos = 0;
+    int i;
+
+/* keeps counting past the end so the caller learns how much room the whole body needs */
+#define STATS_PRINTF(...) \
+    pos += snprintf(pos < size ? buf + pos : NULL, pos < size ? size - pos : 0, __VA_ARGS__)
+
+    relay_stats_collect();
+
+    STATS_PRINTF("# TYPE cncnet_packets_received_total counter\n");
+    STATS_PRINTF("cncnet_packets_received_total %llu\n", (unsigned long long)relay_stats.packets_in);
+    STATS_PRINTF("# TYPE cncnet_bytes_received_total counter\n");
+    STATS_PRINTF("cncnet_bytes_received_total %llu\n", (unsigned long long)relay_stats.bytes_in);
+    STATS_PRINTF("# TYPE cncnet_packets_sent_total counter\n");
+    STATS_PRINTF("cncnet_packets_sent_total %llu\n", (unsigned long long)relay_stats.packets_out);
+    STATS_PRINTF("# TYPE cncnet_bytes_sent_total counter\n");
+    STATS_PRINTF("cncnet_bytes_sent_total %llu\n", (unsigned long long)relay_stats.bytes_out);
+
+    STATS_PRINTF("# TYPE cncnet_commands_total counter\n");
+    for (i = 0; i <= CMD_LAST; i++)
+    {
+        STATS_PRINTF("cncnet_commands_total{cmd=\"%s\"} %llu\n", cmd_str(i), (unsigned long long)relay_stats.cmd[i]);
+    }
+
+    STATS_PRINTF("# TYPE cncnet_relayed_total counter\n");
+    for (i = 0; i < GAME_LAST; i++)
+    {
+        STATS_PRINTF("cncnet_relayed_total{game=\"%s\"} %llu\n", game_str(i), (unsigned long long)relay_stats.game[i]);
+    }
+
+    STATS_PRINTF("# TYPE cncnet_outcomes_total counter\n");
+    for (i = 0; i < OUTCOME_LAST; i++)
+    {
+        STATS_PRINTF("cncnet_outcomes_total{outcome=\"%s\"} %llu\n", outcome_str(i), (unsigned long long)relay_stats.outcome[i]);
+    }
+
+    STATS_PRINTF("# TYPE cncnet_shed_total counter\n");
+    for (i = 0; i < RATE_LAST; i++)
+    {
+        STATS_PRINTF("cncnet_shed_total{class=\"%s\"} %llu\n", rate_str(i), (unsigned long long)relay_stats.shed[i]);
+    }
+    STATS_PRINTF("# TYPE cncnet_shed_subnet_total counter\n");
+    STATS_PRINTF("cncnet_shed_subnet_total %llu\n", (unsigned long long)relay_stats.shed_subnet);
+
+    STATS_PRINTF("# TYPE cncnet_pings_sent_total counter\n");
+    STATS_PRINTF("cncnet_pings_sent_total %llu\n", (unsigned long long)relay_stats.pings_sent);
+    STATS_PRINTF("# TYPE cncnet_pings_lost_total counter\n");
+    STATS_PRINTF("cncnet_pings_lost_total %llu\n", (unsigned long long)relay_stats.pings_lost);
+    STATS_PRINTF("# TYPE cncnet_ping_probes_total counter\n");
+    STATS_PRINTF("cncnet_ping_probes_total %llu\n", (unsigned long long)relay_stats.probes);
+
+    /* client round trips as seen from the relay, the relay itself only adds its own queueing to these.
+     * Without -A only clients that went silent for a ping interval get pinged, so these are mostly
+     * stalled or leaving players and not the ones in a running game */
+    STATS_PRINTF("# HELP cncnet_client_rtt_seconds round trips of pinged clients, only silent ones unless probes are on\n");
+    STATS_PRINTF("# TYPE cncnet_client_rtt_seconds histogram\n");
+    {
+        uint64_t cumulative = 0;
+
+        for (i = 0; i < RTT_BUCKETS; i++)
+        {
+            cumulative += relay_stats.rtt[i];
+            STATS_PRINTF("cncnet_client_rtt_seconds_bucket{le=\"%g\"} %llu\n", rtt_bounds[i] / 1000.0, (unsigned long long)cumulative);
+        }
+
+        STATS_PRINTF("cncnet_client_rtt_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)relay_stats.rtt_samples);
+    }
+    STATS_PRINTF("cncnet_client_rtt_seconds_sum %g\n", relay_stats.rtt_sum_us / 1000000.0);
+    STATS_PRINTF("cncnet_client_rtt_seconds_count %llu\n", (unsigned long long)relay_stats.rtt_samples);
+
+    if (cluster_fd > -1)
+    {
+        STATS_PRINTF("# TYPE cncnet_cluster_datagrams_total counter\n");
+        STATS_PRINTF("cncnet_cluster_datagrams_total{direction=\"in\"} %llu\n", (unsigned long long)cluster_stats.datagrams_in);
+        STATS_PRINTF("cncnet_cluster_datagrams_total{direction=\"out\"} %llu\n", (unsigned long long)cluster_stats.datagrams_out);
+        STATS_PRINTF("# TYPE cncnet_cluster_forwarded_total counter\n");
+        STATS_PRINTF("cncnet_cluster_forwarded_total{direction=\"in\"} %llu\n", (unsigned long long)cluster_stats.forwarded_in);
+        STATS_PRINTF("cncnet_cluster_forwarded_total{direction=\"out\"} %llu\n", (unsigned long long)cluster_stats.forwarded_out);
+        STATS_PRINTF("# TYPE cncnet_cluster_updates_total counter\n");
+        STATS_PRINTF("cncnet_cluster_updates_total{direction=\"in\"} %llu\n", (unsigned long long)cluster_stats.updates_in);
+        STATS_PRINTF("cncnet_cluster_updates_total{direction=\"out\"} %llu\n", (unsigned long long)cluster_stats.updates_out);
+        STATS_PRINTF("# TYPE cncnet_cluster_nodes gauge\n");
+        STATS_PRINTF("cncnet_cluster_nodes %u\n", cluster_stats.nodes);
+        STATS_PRINTF("# TYPE cncnet_cluster_remote_clients gauge\n");
+        STATS_PRINTF("cncnet_cluster_remote_clients %u\n", cluster_stats.remote_clients);
+    }
+
+    {
+        LoopStats total;
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < config.workers; i++)
+        {
+            total.spin_us += loop_stats[i].spin_us;
+            total.block_us += loop_stats[i].block_us;
+            total.relay_us += loop_stats[i].relay_us;
+            total.spin_wakeups += loop_stats[i].spin_wakeups;
+            total.block_wakeups += loop_stats[i].block_wakeups;
+        }
+
+        STATS_PRINTF("# TYPE cncnet_loop_seconds_total counter\n");
+        STATS_PRINTF("cncnet_loop_seconds_total{state=\"spin\"} %g\n", total.spin_us / 1000000.0);
+        STATS_PRINTF("cncnet_loop_seconds_total{state=\"block\"} %g\n", total.block_us / 1000000.0);
+        STATS_PRINTF("cncnet_loop_seconds_total{state=\"relay\"} %g\n", total.relay_us / 1000000.0);
+        STATS_PRINTF("# TYPE cncnet_loop_wakeups_total counter\n");
+        STATS_PRINTF("cncnet_loop_wakeups_total{how=\"spin\"} %llu\n", (unsigned long long)total.spin_wakeups);
+        STATS_PRINTF("cncnet_loop_wakeups_total{how=\"block\"} %llu\n", (unsigned long long)total.block_wakeups);
+
+        if (config.spin)
+        {
+            STATS_PRINTF("# TYPE cncnet_loop_spin_window_seconds gauge\n");
+            for (i = 0; i < config.workers; i++)
+            {
+                STATS_PRINTF("cncnet_loop_spin_window_seconds{worker=\"%d\"} %g\n", i, loop_stats[i].window_us / 1000000.0);
+            }
+        }
+    }
+
+    STATS_PRINTF("# TYPE cncnet_clients gauge\n");
+    for (i = 0; i < GAME_LAST; i++)
+    {
+        STATS_PRINTF("cncnet_clients{game=\"%s\"} %d\n", game_str(i), relay_clients(i));
+    }
+
+    STATS_PRINTF("# TYPE cncnet_uptime_seconds gauge\n");
+    STATS_PRINTF("cncnet_uptime_seconds %llu\n", (unsigned long long)((now - booted) / 1000));
+
+#undef STATS_PRINTF
+
+    return pos;
+}
+
+static size_t metrics_body(char *buf, size_t size, uint64_t now)
+{
+    size_t len;
+
+    relay_read_lock();
+    len = stats_render(buf, size, now);
+    relay_unlock();
+
+    return len;
+}
+
+/* one per line, the game as game_str calls it, the offset and the bytes in hex: RA2 4 36 12 */
+static int signatures_load(const char *path)
+{
+    char line[256], name[32];
+    Signature sig;
+    FILE *fh;
+    int count = 0, lineno = 0, offset, pos, n, byte;
+
+    fh = fopen(path, "r");
+    if (fh == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fh))
+    {
+        lineno++;
+
+        if (sscanf(line, "%31s %d%n", name, &offset, &pos) < 2 || name[0] == '#')
+        {
+            continue;
+        }
+
+        memset(&sig, 0, sizeof(sig));
+        sig.game = GAME_LAST;
+        sig.offset = offset < 0 || offset >= SIGNATURE_WINDOW ? SIGNATURE_WINDOW : offset;
+
+        for (byte = 0; byte < GAME_LAST; byte++)
+        {
+            if (strcmp(name, game_str(byte)) == 0)
+            {
+                sig.game = byte;
+            }
+        }
+
+        while (sig.len < SIGNATURE_WINDOW && sscanf(line + pos, "%x%n", &byte, &n) == 1)
+        {
+            sig.bytes[sig.len++] = byte;
+            pos += n;
+        }
+
+        if (relay_signature(&sig) < 0)
+        {
+            fprintf(stderr, "%s:%d: bad signature or too many of them\n", path, lineno);
+            continue;
+        }
+
+        count++;
+    }
+
+    fclose(fh);
+    return count;
+}
+
+/* low latency mode, pin the worker to its own cpu and raise it to the real time class where asked for */
+static void relay_thread_setup(int worker)
+{
+#ifdef __linux__
+    int err;
+
+    if (config.cpu > -1)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(config.cpu + worker, &set);
+
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        {
+            log_printf("Worker %d could not be pinned to cpu %d: %s\n", worker, config.cpu + worker, strerror(err));
+        }
+    }
+
+    if (config.fifo > 0)
+    {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config.fifo;
+
+        if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+        {
+            log_printf("Worker %d could not switch to SCHED_FIFO: %s\n", worker, strerror(err));
+        }
+    }
+
+    if (config.spin && net_opt_busypoll(net_socket, config.spin) < 0)
+    {
+        log_printf("Worker %d could not enable busy polling: %s\n", worker, strerror(errno));
+    }
+#endif
+}
+
+/* spin on an empty socket for a window after the last work and block after that, the window doubles when
+ * work shows up soon enough that spinning up to the limit would have caught it and halves when it doesn't */
+static int spin_wait(LoopStats *ls, uint64_t idle_since)
+{
+    uint64_t start = timer_now_us(), waited;
+    int ready;
+
+    if (start - idle_since < ls->window_us)
+    {
+        ready = net_wait(0);
+        waited = timer_now_us() - start;
+
+        if (ready > 0)
+        {
+            ls->spin_wakeups++;
+        }
+
+        ls->spin_us += waited;
+        return ready;
+    }
+
+    ready = net_wait(1000);
+    waited = timer_now_us() - start;
+    ls->block_us += waited;
+
+    if (ready > 0)
+    {
+        ls->block_wakeups++;
+    }
+
+    if (config.spin)
+    {
+        if (ready > 0 && waited <= config.spin)
+        {
+            ls->window_us = ls->window_us * 2 < config.spin ? ls->window_us * 2 : config.spin;
+        }
+        else if (waited > config.spin)
+        {
+            ls->window_us = ls->window_us / 2 > SPIN_MIN_US ? ls->window_us / 2 : SPIN_MIN_US;
+        }
+    }
+
+    return ready;
+}
 
 int interrupt = 0;
 void onsigint(int signum)
@@ -95,36 +461,315 @@ void onsigterm(int signum)
     printf("Received SIGTERM, exiting...");
     interrupt = 1;
 }
+/* only there to get a worker out of net_wait */
+void onsigwake(int signum)
+{
+}
 
-int main(int argc, char **argv)
+/* stop taking packets off this worker's socket, relaying the ones io_uring already did since the new
+ * process never sees them */
+static void relay_quiesce(uint64_t now)
+{
+    struct sockaddr_in peer;
+    int len;
+
+    if (!net_uring_enabled())
+    {
+        return;
+    }
+
+    net_uring_stop();
+    relay_lock();
+
+    while (net_ready(net_socket))
+    {
+        net_recv_batch(config.batch);
+
+        while ((len = net_recv_next(&peer)) > -1)
+        {
+            relay_packet(&peer, len, now);
+        }
+    }
+
+    cluster_flush(now);
+    relay_unlock();
+
+    net_flush();
+    net_uring_free();
+}
+
+/* the other workers wait here while worker 0 hands over, they go back to work only if it failed */
+static void relay_park(uint64_t now)
+{
+    relay_quiesce(now);
+    __atomic_add_fetch(&handoff_parked, 1, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&handoff_parking, __ATOMIC_ACQUIRE))
+    {
+        usleep(1000);
+    }
+
+    __atomic_sub_fetch(&handoff_parked, 1, __ATOMIC_RELEASE);
+
+    if (!interrupt && config.uring)
+    {
+        net_uring_init();
+    }
+}
+
+/* a new process wants to take over, it gets the sockets and the clients and this one steps aside */
+static void relay_handoff(uint64_t now)
 {
-    Client *client;
-    Client *clients = NULL;
-    Config config;
+    RelaySnapshot *snap;
+    int conn, count;
+
+    conn = handoff_accept(handoff_fd);
+    if (conn < 0)
+    {
+        return;
+    }
+
+    /* every worker's socket goes, so every worker has to be done with its own first */
+    __atomic_store_n(&handoff_parking, 1, __ATOMIC_RELEASE);
+    relay_quiesce(now);
+
+    while (__atomic_load_n(&handoff_parked, __ATOMIC_ACQUIRE) < __atomic_load_n(&workers_running, __ATOMIC_ACQUIRE) - 1)
+    {
+#ifndef WIN32
+        int i;
+
+        /* again and again, a worker may have been just about to block when it got the last one */
+        for (i = 1; i < config.workers; i++)
+        {
+            pthread_kill(workers[i], SIGUSR1);
+        }
+#endif
+        usleep(1000);
+    }
+
+    /* the others kept relaying meanwhile, their packets are newer than the time this started */
+    now = timer_now();
 
-    int s, opt;
-    fd_set rfds;
-    struct timeval tv;
+    relay_lock();
+    snap = malloc(sizeof(RelaySnapshot) * (relay_clients(-1) + 1));
+    count = snap ? relay_snapshot(snap, relay_clients(-1), now) : -1;
+    relay_unlock();
+
+    if (count < 0 || handoff_give(conn, worker_socks, config.workers, snap, count) < 0)
+    {
+        log_printf("Handoff failed: %s\n", strerror(errno));
+        handoff_close(conn);
+        free(snap);
+
+        if (config.uring)
+        {
+            net_uring_init();
+        }
+
+        __atomic_store_n(&handoff_parking, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    log_printf("Handed %d sockets and %d clients over to the new process\n", config.workers, count);
+
+    /* the new process waits for the connection to close before it opens these */
+    if (metrics_fd > -1)
+    {
+        metrics_close(metrics_fd);
+        metrics_fd = -1;
+    }
+    cluster_close();
+    cluster_fd = -1;
+
+    handoff_close(conn);
+    free(snap);
+
+    interrupt = 1;
+    __atomic_store_n(&handoff_parking, 0, __ATOMIC_RELEASE);
+}
+
+/* one per worker, each with its own socket bound to the same address with SO_REUSEPORT */
+void *relay_loop(void *arg)
+{
+    int worker = (intptr_t)arg;
+    LoopStats *ls = &loop_stats[worker];
+    uint64_t idle_since = 0, busy_since, status_second = 0;
     struct sockaddr_in peer;
-    char buf[NET_BUF_SIZE];
-    time_t booted = time(NULL);
+    int len;
+
+    if (worker > 0)
+    {
+        net_init();
+
+        if (worker_socks[worker] > -1)
+        {
+            net_adopt(worker_socks[worker]);
+        }
+        else
+        {
+            net_opt_reuseport(net_socket);
+
+            if (net_bind(config.ip, config.port) < 0)
+            {
+                log_printf("Worker %d failed to bind: %s\n", worker, strerror(errno));
+                net_close();
+                return NULL;
+            }
+
+            worker_socks[worker] = net_socket;
+        }
+
+        if (config.uring)
+        {
+            net_uring_init();
+        }
+    }
+
+    relay_thread_setup(worker);
+    ls->window_us = config.spin;
+    __atomic_add_fetch(&workers_running, 1, __ATOMIC_RELEASE);
+
+    while (!interrupt)
+    {
+        uint64_t now = timer_now();
+        int ready;
+
+        /* only once a second, a spinning worker comes by here far more often */
+        if (worker == 0 && now / 1000 != status_second)
+        {
+            status_second = now / 1000;
+            relay_read_lock();
+            relay_status(now);
+            relay_unlock();
+        }
+
+        ready = spin_wait(ls, idle_since);
+
+        /* before anything more is read from the socket */
+        if (worker > 0 && __atomic_load_n(&handoff_parking, __ATOMIC_ACQUIRE))
+        {
+            relay_park(timer_now());
+            continue;
+        }
+
+        if (ready < 0 || interrupt)
+        {
+            continue;
+        }
+
+        /* an empty poll while spinning, the timers are looked after once the worker blocks again */
+        if (ready == 0 && config.spin && timer_now_us() - idle_since < ls->window_us)
+        {
+            continue;
+        }
 
-    uint32_t last_packets = 0;
-    uint32_t last_bytes = 0;
-    uint32_t last_time = 0;
+        now = timer_now();
+        busy_since = timer_now_us();
 
-    uint32_t total_packets = 0;
-    uint32_t total_bytes = 0;
-    uint32_t bps = 0;
-    uint32_t pps = 0;
+        if (net_ready(net_socket))
+        {
+            net_recv_batch(config.batch);
+        }
+
+        if (worker == 0 && metrics_fd > -1)
+        {
+            metrics_poll(metrics_fd, metrics_body, now);
+        }
+
+        if (worker == 0 && cluster_fd > -1 && net_ready(cluster_fd))
+        {
+            relay_lock();
+            cluster_recv(now);
+            relay_unlock();
+        }
+
+        while ((len = net_recv_next(&peer)) > -1)
+        {
+            int ret;
+
+            relay_read_lock();
+            ret = relay_packet_shared(&peer, len, now);
+            relay_unlock();
+
+            if (ret == RELAY_EXCLUSIVE)
+            {
+                relay_lock();
+                relay_packet_exclusive(&peer, now);
+                relay_unlock();
+            }
+        }
+
+        /* whatever this batch had for other nodes goes out together */
+        if (cluster_fd > -1)
+        {
+            relay_lock();
+            cluster_flush(now);
+            relay_unlock();
+        }
+
+        /* check for timeouts */
+        if (worker == 0)
+        {
+            relay_lock();
+            relay_timeouts(now);
+            snapshot_save(now);
+            relay_unlock();
+        }
+
+        net_flush();
+
+        /* last, so everything read from the sockets so far is in the snapshot */
+        if (worker == 0 && handoff_fd > -1 && net_ready(handoff_fd))
+        {
+            relay_handoff(now);
+        }
+
+        if (ready > 0)
+        {
+            idle_since = timer_now_us();
+            ls->relay_us += idle_since - busy_since;
+        }
+    }
+
+    __atomic_sub_fetch(&workers_running, 1, __ATOMIC_RELEASE);
+
+    if (worker > 0)
+    {
+        net_close();
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    RelaySnapshot *snap;
+    int opt, i, socks[HANDOFF_SOCKETS], nsocks, count = -1, sigs = 0;
 
     config.port = 9001;
     strcpy(config.ip, "0.0.0.0");
     strcpy(config.hostname, "Unnamed CnCNet 4.0 Server");
     config.timeout = 10;
     config.maxclients = 0;
+    config.batch = 32;
+    config.workers = 1;
+    config.metrics = 0;
+    config.capture[0] = '\0';
+    memset(config.rate, 0, sizeof(config.rate));
+    config.uring = 0;
+    config.cluster = 0;
+    config.nodes[0] = '\0';
+    config.handoff[0] = '\0';
+    config.snapshot[0] = '\0';
+    config.signatures[0] = '\0';
+    config.spin = 0;
+    config.cpu = -1;
+    config.fifo = 0;
+    config.probe = 0;
+
+    booted = timer_now();
 
-    while ((opt = getopt(argc, argv, "?hi:n:t:c:l:")) != -1)
+    while ((opt = getopt(argc, argv, "?hi:n:t:c:b:w:m:d:l:r:uC:N:U:s:g:L:P:R:A")) != -1)
     {
         switch (opt)
         {
@@ -152,10 +797,115 @@ int main(int argc, char **argv)
                     config.maxclients = 0;
                 }
                 break;
+            case 'b':
+                config.batch = atoi(optarg);
+                if (config.batch < 1)
+                {
+                    config.batch = 1;
+                }
+                else if (config.batch > NET_BATCH_MAX)
+                {
+                    config.batch = NET_BATCH_MAX;
+                }
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                if (config.workers < 1)
+                {
+                    config.workers = 1;
+                }
+                else if (config.workers > 64)
+                {
+                    config.workers = 64;
+                }
+                break;
+            case 'm':
+                config.metrics = atoi(optarg);
+                if (config.metrics < 0 || config.metrics > 65535)
+                {
+                    config.metrics = 0;
+                }
+                break;
+            case 'd':
+                strncpy(config.capture, optarg, sizeof(config.capture)-1);
+                break;
+            case 'C':
+                config.cluster = atoi(optarg);
+                if (config.cluster < 0 || config.cluster > 65535)
+                {
+                    config.cluster = 0;
+                }
+                break;
+            case 'N':
+                strncpy(config.nodes, optarg, sizeof(config.nodes)-1);
+                break;
+            case 'u':
+                config.uring = 1;
+                break;
+            case 'A':
+                config.probe = 1;
+                break;
+            case 'U':
+                strncpy(config.handoff, optarg, sizeof(config.handoff)-1);
+                break;
+            case 's':
+                strncpy(config.snapshot, optarg, sizeof(config.snapshot)-1);
+                break;
+            case 'g':
+                strncpy(config.signatures, optarg, sizeof(config.signatures)-1);
+                break;
+            case 'L':
+                config.spin = atoi(optarg);
+                if (config.spin < 0)
+                {
+                    config.spin = 0;
+                }
+                else if (config.spin > 1000000)
+                {
+                    config.spin = 1000000;
+                }
+                else if (config.spin > 0 && config.spin < SPIN_MIN_US)
+                {
+                    config.spin = SPIN_MIN_US;
+                }
+                break;
+            case 'P':
+                config.cpu = atoi(optarg);
+                if (config.cpu < 0)
+                {
+                    config.cpu = -1;
+                }
+                break;
+            case 'R':
+                config.fifo = atoi(optarg);
+                if (config.fifo < 0)
+                {
+                    config.fifo = 0;
+                }
+                else if (config.fifo > 99)
+                {
+                    config.fifo = 99;
+                }
+                break;
+            case 'r':
+                memset(config.rate, 0, sizeof(config.rate));
+                sscanf(optarg, "%d,%d,%d", &config.rate[RATE_QUERY], &config.rate[RATE_BROADCAST], &config.rate[RATE_DIRECT]);
+                for (i = 0; i < RATE_LAST; i++)
+                {
+                    if (config.rate[i] < 0)
+                    {
+                        config.rate[i] = 0;
+                    }
+                    else if (config.rate[i] > RATE_MAX)
+                    {
+                        config.rate[i] = RATE_MAX;
+                    }
+                }
+                break;
             case 'h':
             case '?':
             default:
-                fprintf(stderr, "Usage: %s [-h?] [-i ip] [-n hostname] [-t timeout] [-c maxclients] [port]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-h?] [-i ip] [-n hostname] [-t timeout] [-c maxclients] [-b batch] [-w workers] [-m metrics port] [-d capture file] [-r query,broadcast,direct per second] [-u] [-A ping active clients for rtt] [-C cluster port -N ip:port,...] [-U handoff socket] [-s snapshot file] [-g signature file] [-L spin usec] [-P first cpu] [-R fifo priority] [port]\n", argv[0]);
                 return 1;
         }
     }
@@ -173,7 +923,26 @@ int main(int argc, char **argv)
         }
     }
 
-    s = net_init();
+#ifdef WIN32
+    config.workers = 1;
+#endif
+
+    net_init();
+    relay_init(config.hostname, config.timeout, config.maxclients, NULL, booted);
+
+    relay_probe(config.probe);
+
+    if (relay_limit(config.rate) < 0)
+    {
+        perror("ratelimit");
+        return 1;
+    }
+
+    if (config.signatures[0] && (sigs = signatures_load(config.signatures)) < 0)
+    {
+        perror("signatures");
+        return 1;
+    }
 
     printf("CnCNet 4.0 Server\n");
     printf("=================\n");
@@ -182,323 +951,233 @@ int main(int argc, char **argv)
     printf("   hostname: %s\n", config.hostname);
     printf("    timeout: %d seconds\n", config.timeout);
     printf(" maxclients: %d\n", config.maxclients);
+    printf("      batch: %d packets\n", config.batch);
+    printf("    workers: %d\n", config.workers);
+    printf("         io: %s\n", config.uring ? "io_uring" : "classic");
+    if (config.probe)
+    {
+        printf("     probes: pinging active clients for their round trip\n");
+    }
+    else
+    {
+        printf("     probes: off, round trips only of clients that went silent\n");
+    }
+    if (config.metrics)
+    {
+        printf("    metrics: http://127.0.0.1:%d/metrics\n", config.metrics);
+    }
+    if (config.capture[0])
+    {
+        printf("    capture: %s\n", config.capture);
+    }
+    if (config.cluster)
+    {
+        printf("    cluster: port %d, nodes %s\n", config.cluster, config.nodes[0] ? config.nodes : "none");
+    }
+    if (config.handoff[0])
+    {
+        printf("    handoff: %s\n", config.handoff);
+    }
+    if (config.snapshot[0])
+    {
+        printf("   snapshot: %s\n", config.snapshot);
+    }
+    if (config.signatures[0])
+    {
+        printf(" signatures: %d from %s\n", sigs, config.signatures);
+    }
+    if (config.spin || config.cpu > -1 || config.fifo)
+    {
+        printf("    latency: spin up to %d us", config.spin);
+        if (config.cpu > -1)
+        {
+            printf(", pinned from cpu %d", config.cpu);
+        }
+        if (config.fifo)
+        {
+            printf(", SCHED_FIFO %d", config.fifo);
+        }
+        printf("\n");
+    }
+    if (config.rate[RATE_QUERY] || config.rate[RATE_BROADCAST] || config.rate[RATE_DIRECT])
+    {
+        printf("  ratelimit: %d queries, %d broadcasts, %d direct per second per ip, %dx per /24\n",
+            config.rate[RATE_QUERY], config.rate[RATE_BROADCAST], config.rate[RATE_DIRECT], RATE_SUBNET_SCALE);
+    }
     printf("    version: %s\n", VERSION);
     printf("\n");
 
-    net_bind(config.ip, config.port);
-
-    FD_ZERO(&rfds);
-    FD_SET(s, &rfds);
-    memset(&tv, 0, sizeof(tv));
-
-    signal(SIGINT, onsigint);
-    signal(SIGTERM, onsigterm);
-
-    while (!interrupt)
+    for (i = 0; i < 64; i++)
     {
-        time_t now = time(NULL);
-        int num_clients = 0;
+        worker_socks[i] = -1;
+    }
 
-        if (now > last_time)
+    if (config.handoff[0] && (count = handoff_take(config.handoff, socks, &nsocks, &snap)) > -1)
+    {
+        /* the sockets share the port with SO_REUSEPORT or not at all, so the workers follow the old process */
+        for (i = 0; i < nsocks && i < 64; i++)
         {
-            int stat_elapsed = now - last_time ;
-            pps = (total_packets - last_packets) / stat_elapsed;
-            bps = (total_bytes - last_bytes) / stat_elapsed;
-            last_packets = total_packets;
-            last_bytes = total_bytes;
-            last_time = now;
-
-            num_clients = 0;
-            LIST_FOREACH (clients, client)
-            {
-                num_clients++;
-            }
-
-            log_statusf("%s [ %d/%d | %d p/s, %d kB/s | total: %d p, %d kB ]",
-                config.hostname, num_clients, config.maxclients, pps, bps / 1024, total_packets, total_bytes / 1024);
+            worker_socks[i] = socks[i];
         }
 
-        net_send_discard();
-        FD_ZERO(&rfds);
-        FD_SET(s, &rfds);
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-
-        if (select(s + 1, &rfds, NULL, NULL, &tv) > -1 && !interrupt)
+        config.workers = i;
+        net_adopt(worker_socks[0]);
+        printf("Took over from the running server, %d of %d clients restored, %d workers\n\n", relay_restore(snap, count, timer_now()), count, config.workers);
+        free(snap);
+    }
+    else if (config.handoff[0] && errno != ENOENT && errno != ECONNREFUSED)
+    {
+        perror("handoff");
+        return 1;
+    }
+    else
+    {
+        if (config.workers > 1)
         {
-            now = time(NULL);
-
-            if (FD_ISSET(s, &rfds))
-            {
-                size_t len = net_recv(&peer);
-                uint8_t cmd;
-
-                total_packets++;
-                total_bytes += len;
+            net_opt_reuseport(net_socket);
+        }
 
-                if (len == 0)
-                {
-                    continue;
-                }
+        if (net_bind(config.ip, config.port) < 0)
+        {
+            perror("bind");
+            return 1;
+        }
 
-                cmd = net_read_int8();
+        worker_socks[0] = net_socket;
+    }
 
-                if (cmd == CMD_QUERY)
-                {
-                    /* query responds with the basic server information to display on a server browser */
-                    int cnt[GAME_LAST] = { 0, 0, 0, 0, 0, 0, 0 };
+    if (config.snapshot[0])
+    {
+        if (snapshot_open(config.snapshot) < 0)
+        {
+            perror("snapshot");
+            return 1;
+        }
 
-                    num_clients = 0;
-                    LIST_FOREACH (clients, client)
-                    {
-                        cnt[client->game]++;
-                        num_clients++;
-                    }
+        /* a handoff has the current clients, the file only what they were a moment ago */
+        if (count < 0)
+        {
+            printf("%d clients restored from the snapshot\n\n", snapshot_load(timer_now()));
+        }
+    }
 
-                    net_write_int8(CMD_QUERY);
-                    net_write_string("hostname");
-                    net_write_string(config.hostname);
-                    net_write_string("clients");
-                    net_write_string_int32(num_clients);
-                    net_write_string("maxclients");
-                    net_write_string_int32(config.maxclients);
-                    net_write_string("version");
-                    net_write_string(VERSION);
-                    net_write_string("uptime");
-                    net_write_string_int32(now - booted);
-                    net_write_string("unk");
-                    net_write_string_int32(cnt[GAME_UNKNOWN]);
-                    net_write_string("cnc95");
-                    net_write_string_int32(cnt[GAME_CNC95]);
-                    net_write_string("ra95");
-                    net_write_string_int32(cnt[GAME_RA95]);
-                    net_write_string("ts");
-                    net_write_string_int32(cnt[GAME_TS]);
-                    net_write_string("tsdta");
-                    net_write_string_int32(cnt[GAME_TSDTA]);
-                    net_write_string("tsti");
-                    net_write_string_int32(cnt[GAME_TSTI]);
-                    net_write_string("ra2");
-                    net_write_string_int32(cnt[GAME_RA2]);
-
-                    net_send(&peer);
-                    total_packets++;
-                    continue;
-                }
+    if (config.uring && net_uring_init() < 0)
+    {
+        printf("io_uring is not supported here, using the classic path\n\n");
+    }
 
-                if (cmd == CMD_TESTP2P)
-                {
-                    net_write_int8(CMD_TESTP2P);
-                    net_write_int32(net_read_int32());
-                    peer.sin_port = htons(8054);
+    if (config.metrics)
+    {
+        metrics_fd = metrics_open(config.metrics);
+        if (metrics_fd < 0)
+        {
+            perror("metrics");
+            return 1;
+        }
 
-                    net_send(&peer);
-                    total_packets++;
-                    continue;
-                }
+        net_watch(metrics_fd);
+    }
 
-                /* look for our client */
-                client = NULL;
-                Client *a;
-                LIST_FOREACH (clients, a)
-                {
-                    if (a->addr.sin_addr.s_addr == peer.sin_addr.s_addr && a->addr.sin_port == peer.sin_port)
-                    {
-                        client = a;
-                        break;
-                    }
-                }
+    if (config.cluster)
+    {
+        cluster_fd = cluster_open(config.ip, config.cluster, config.nodes, booted);
+        if (cluster_fd < 0)
+        {
+            perror("cluster");
+            return 1;
+        }
 
-                if (client == NULL)
-                {
-                    /* ignore disconnect packets swhen not connected */
-                    if (cmd == CMD_DISCONNECT)
-                    {
-                        continue;
-                    }
+        net_watch(cluster_fd);
+    }
 
-                    /* ignore new clients when hitting the maximum, can't do much more than that */
-                    if (config.maxclients > 0 && num_clients == config.maxclients)
-                    {
-                        continue;
-                    }
+    if (config.handoff[0])
+    {
+        handoff_fd = handoff_listen(config.handoff);
+        if (handoff_fd < 0)
+        {
+            perror("handoff");
+            return 1;
+        }
 
-                    client = LIST_NEW(Client);
-                    memcpy(&client->addr, &peer, sizeof peer);
-                    LIST_INSERT(clients, client);
-                }
+        net_watch(handoff_fd);
+    }
 
-                if (cmd == CMD_DISCONNECT)
-                {
-                    log_printf("%s:%d disconnected\n", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
-                    LIST_REMOVE(clients, client);
-                    FREE(client);
-                    /* special packet from clients who are closing the socket so we can remove them from the active list before timeout */
-                    continue;
-                }
+    if (config.capture[0] && net_capture_open(config.capture) < 0)
+    {
+        perror("capture");
+        return 1;
+    }
 
-                if (cmd == CMD_PING)
-                {
-                    net_read_int32();
-                    client->last_packet = now;
-                    client->ping_count = 0;
-                    continue;
-                }
+    signal(SIGINT, onsigint);
+    signal(SIGTERM, onsigterm);
+#ifndef WIN32
+    signal(SIGUSR1, onsigwake);
+#endif
 
-                uint32_t to_ip = net_read_int32();
-                uint16_t to_port = net_read_int16();
-                Client *client_to = NULL;
-                len = net_read_data(buf, sizeof(buf));
+    if (log_init() < 0)
+    {
+        fprintf(stderr, "Failed to start logging thread, logging synchronously\n");
+    }
 
-                /* discard invalid destinations */
-                if (to_ip == 0 || to_port == 0) {
-                    /* if it was a complete stray packet, just ignore the client completely */
-                    if (client->game == GAME_UNKNOWN)
-                    {
-                        LIST_REMOVE(clients, client);
-                        FREE(client);
-                    }
-                    continue;
-                }
+#ifdef WIN32
+    relay_loop(NULL);
+#else
+    workers = calloc(config.workers, sizeof(pthread_t));
 
-                /* broadcast */
-                if (to_ip == 0xFFFFFFFF)
-                {
-                    /* try to detect any supported game */
-                    if (buf[0] == 0x34 && buf[1] == 0x12)
-                    {
-                        client->game = GAME_CNC95;
-                    }
-                    else if (buf[0] == 0x35 && buf[1] == 0x12)
-                    {
-                        client->game = GAME_RA95;
-                    }
-                    else if (buf[4] == 0x35 && buf[5] == 0x12)
-                    {
-                        client->game = GAME_TS;
-                    }
-                    else if (buf[4] == 0x35 && buf[5] == 0x13)
-                    {
-                        client->game = GAME_TSDTA;
-                    }
-                    else if (buf[4] == 0x35 && buf[5] == 0x14)
-                    {
-                        client->game = GAME_TSTI;
-                    }
-                    else if (buf[4] == 0x36 && buf[5] == 0x12)
-                    {
-                        client->game = GAME_RA2;
-                    }
-                    else
-                    {
-                        client->game = GAME_UNKNOWN;
-                    }
+    /* worker 0 is the main thread and keeps the socket opened above */
+    for (i = 1; i < config.workers; i++)
+    {
+        if (pthread_create(&workers[i], NULL, relay_loop, (void *)(intptr_t)i) != 0)
+        {
+            fprintf(stderr, "Failed to start worker %d\n", i);
+            interrupt = 1;
+            config.workers = i;
+            break;
+        }
+    }
 
-                    client->p2p = (cmd == CMD_P2P);
+    relay_loop(NULL);
 
-                    if (client->last_packet == 0)
-                    {
-                        log_printf("%s:%d connected with %s (%s)\n", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port), game_str(client->game), cmd == CMD_P2P ? "p2p" : "tun");
-                    }
+    for (i = 1; i < config.workers; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
 
-                    /* hack: the motd bot can connect with an empty broadcast without broadcasting anything */
-                    if (len)
-                    {
-                        net_write_int8(cmd);
-                        net_write_int32(peer.sin_addr.s_addr);
-
-                        /* fake P2P port, always */
-                        if (cmd == CMD_P2P)
-                        {
-                            net_write_int16(htons(8054));
-                        }
-                        else
-                        {
-                            net_write_int16(peer.sin_port);
-                        }
-
-                        net_write_data(buf, len);
-
-                        LIST_FOREACH (clients, client_to)
-                        {
-                            /* hack: sending all broadcasts to unknown clients so the welcome bot gets connects, can also be used to monitor cncnet */
-                            if (client_to != client && (client_to->game == client->game || client_to->game == GAME_UNKNOWN))
-                            {
-                                net_send_noflush(&client_to->addr);
-                                total_packets++;
-                            }
-                        }
-
-                        net_send_discard();
-                    }
-                }
-                else
-                /* direct */
-                {
-                    if (client->last_packet == 0)
-                    {
-                        log_printf("%s:%d connected with direct packet, possibly a desync\n", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
-                    }
+    free(workers);
+#endif
 
-                    Client *tmp;
-                    LIST_FOREACH (clients, tmp)
-                    {
-                        /* hack: if someone from the destination ip is registered as p2p client, ignore destination port */
-                        if (tmp->addr.sin_addr.s_addr == to_ip && (tmp->addr.sin_port == to_port || (ntohs(to_port) == 8054 && tmp->p2p)))
-                        {
-                            client_to = tmp;
-                            break;
-                        }
-                    }
+    log_free();
+    printf("\n");
 
-                    if (client_to == NULL)
-                    {
-                        log_printf("%s:%d tried to send to unknown client %s:%d\n", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port), inet_ntoa(*(struct in_addr *)&to_ip), ntohs(to_port));
-                    }
-                    else
-                    {
-                        net_write_int8(cmd);
-                        net_write_int32(peer.sin_addr.s_addr);
-                        net_write_int16(peer.sin_port);
-                        net_write_data(buf, len);
-                        net_send(&client_to->addr);
-                        total_packets++;
-                    }
-                }
+    {
+        uint64_t spin = 0, block = 0, relay = 0, total;
 
-                client->last_packet = now;
-                client->ping_count = 0;
-            }
+        for (i = 0; i < config.workers; i++)
+        {
+            spin += loop_stats[i].spin_us;
+            block += loop_stats[i].block_us;
+            relay += loop_stats[i].relay_us;
+        }
 
-            /* check for timeouts */
-            LIST_FOREACH (clients, client)
-            {
-                if (now - client->last_packet > config.timeout)
-                {
-                    if (now - client->last_ping > 5 && client->ping_count > 2)
-                    {
-                        log_printf("%s:%d timed out\n", inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
-                        LIST_REMOVE(clients, client);
-                        FREE(client);
-                    }
-                    else if (now - client->last_ping > 5)
-                    {
-                        net_write_int8(CMD_PING);
-                        net_write_int32(client->ping_count);
-                        net_send(&client->addr);
-                        client->last_ping = now;
-                        client->ping_count++;
-                        total_packets++;
-                    }
-                }
-            }
+        total = spin + block + relay;
+        if (total > 0)
+        {
+            printf("Workers spent %.1f%% spinning, %.1f%% relaying and %.1f%% blocked\n",
+                spin * 100.0 / total, relay * 100.0 / total, block * 100.0 / total);
         }
     }
 
-    printf("\n");
+    cluster_close();
+    relay_free();
 
-    LIST_FREE(clients);
+    if (metrics_fd > -1)
+    {
+        metrics_close(metrics_fd);
+    }
 
+    net_capture_close();
+    handoff_close(handoff_fd);
+    snapshot_close();
     net_free();
     return 0;
 }
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "net.h"
+#include "rate.h"
+#include "relay.h"
+#include "handoff.h"
+
+#ifndef WIN32
+    #include <sys/un.h>
+#endif
+
+#define HANDOFF_MAGIC   0x434E4832
+/* far more than any relay has, a bad header must not turn into a huge allocation */
+#define HANDOFF_MAX     (1 << 24)
+
+#ifndef WIN32
+
+static int handoff_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int handoff_read(int fd, void *buf, size_t len)
+{
+    size_t pos = 0;
+    ssize_t ret;
+
+    while (pos < len)
+    {
+        ret = read(fd, (char *)buf + pos, len - pos);
+
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ret <= 0)
+        {
+            if (ret == 0)
+            {
+                errno = EPIPE;
+            }
+            return -1;
+        }
+
+        pos += ret;
+    }
+
+    return 0;
+}
+
+static int handoff_write(int fd, const void *buf, size_t len)
+{
+    size_t pos = 0;
+    ssize_t ret;
+
+    while (pos < len)
+    {
+        ret = send(fd, (const char *)buf + pos, len - pos, MSG_NOSIGNAL);
+
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ret < 0)
+        {
+            return -1;
+        }
+
+        pos += ret;
+    }
+
+    return 0;
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (handoff_addr(&addr, path) < 0)
+    {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    /* whoever had the path before is either gone or has just handed over to us */
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int handoff_take(const char *path, int *socks, int *nsocks, RelaySnapshot **snap)
+{
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_SOCKETS)];
+    uint32_t header[2];
+    ssize_t ret;
+    char eof;
+    int fd, i;
+
+    *nsocks = 0;
+    *snap = NULL;
+
+    if (handoff_addr(&addr, path) < 0)
+    {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(header))
+    {
+        goto fail;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && *nsocks == 0)
+        {
+            *nsocks = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(socks, CMSG_DATA(cmsg), sizeof(int) * *nsocks);
+        }
+    }
+
+    if (*nsocks == 0 || (msg.msg_flags & MSG_CTRUNC) || header[0] != HANDOFF_MAGIC || header[1] > HANDOFF_MAX)
+    {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    *snap = malloc(sizeof(RelaySnapshot) * (header[1] + 1));
+    if (*snap == NULL || handoff_read(fd, *snap, sizeof(RelaySnapshot) * header[1]) < 0)
+    {
+        goto fail;
+    }
+
+    /* the old process lets go of its other ports before it closes the connection */
+    do
+    {
+        ret = read(fd, &eof, 1);
+    } while (ret > 0 || (ret < 0 && errno == EINTR));
+
+    close(fd);
+    return header[1];
+
+fail:
+    for (i = 0; i < *nsocks; i++)
+    {
+        close(socks[i]);
+    }
+
+    *nsocks = 0;
+
+    free(*snap);
+    *snap = NULL;
+
+    if (errno == ENOENT || errno == ECONNREFUSED)
+    {
+        errno = EPROTO;
+    }
+
+    close(fd);
+    return -1;
+}
+
+int handoff_accept(int fd)
+{
+    return accept(fd, NULL, NULL);
+}
+
+int handoff_give(int conn, const int *socks, int nsocks, const RelaySnapshot *snap, int count)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_SOCKETS)];
+    uint32_t header[2];
+
+    if (nsocks < 1 || nsocks > HANDOFF_SOCKETS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    header[0] = HANDOFF_MAGIC;
+    header[1] = count;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nsocks);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nsocks);
+    memcpy(CMSG_DATA(cmsg), socks, sizeof(int) * nsocks);
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(header))
+    {
+        return -1;
+    }
+
+    return handoff_write(conn, snap, sizeof(RelaySnapshot) * count);
+}
+
+void handoff_close(int fd)
+{
+    if (fd > -1)
+    {
+        close(fd);
+    }
+}
+
+#else
+
+/* no unix sockets to pass a descriptor over */
+int handoff_listen(const char *path)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int handoff_take(const char *path, int *socks, int *nsocks, RelaySnapshot **snap)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int handoff_accept(int fd)
+{
+    return -1;
+}
+
+int handoff_give(int conn, const int *socks, int nsocks, const RelaySnapshot *snap, int count)
+{
+    return -1;
+}
+
+void handoff_close(int fd)
+{
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Restarts without dropping a packet. A running relay listens on a unix
+ * socket, a new process started with the same path connects to it and is
+ * given the bound relay sockets, one per worker, with SCM_RIGHTS and a snapshot
+ * of the clients:
+ *
+ *   header     magic(4) count(4), sent with the descriptors
+ *   clients    count RelaySnapshot records
+ *
+ * All in host byte order, both ends are the same machine. The old process
+ * stops reading from the sockets before the snapshot is taken, releases its
+ * other ports and closes the connection, so once the new process sees the
+ * end of it nothing is left in its way. Include net.h and relay.h first.
+ */
+
+/* at most this many sockets are handed over */
+#define HANDOFF_SOCKETS 64
+
+int handoff_listen(const char *path);
+/* socks has room for HANDOFF_SOCKETS, returns the number of clients or -1, errno is ENOENT or ECONNREFUSED
+ * when no relay is running there */
+int handoff_take(const char *path, int *socks, int *nsocks, RelaySnapshot **snap);
+/* accept the connection of the new process, then give it the sockets and the clients */
+int handoff_accept(int fd);
+int handoff_give(int conn, const int *socks, int nsocks, const RelaySnapshot *snap, int count);
+void handoff_close(int fd);
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "hash.h"
+
+#define HASH_MIN_SIZE 64
+
+static uint32_t hash_slot(Hash *h, uint64_t key)
+{
+    /* 64bit finalizer from MurmurHash3, keys are packed ip/port pairs that cluster badly otherwise */
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t)key & h->mask;
+}
+
+static void hash_resize(Hash *h, uint32_t size)
+{
+    HashEntry *old = h->entries;
+    uint32_t old_size = old ? h->mask + 1 : 0;
+    uint32_t i;
+
+    h->entries = calloc(size, sizeof(HashEntry));
+    assert(h->entries != NULL);
+    h->mask = size - 1;
+    h->count = 0;
+
+    for (i = 0; i < old_size; i++)
+    {
+        if (old[i].value)
+        {
+            hash_put(h, old[i].key, old[i].value);
+        }
+    }
+
+    free(old);
+}
+
+void hash_init(Hash *h)
+{
+    memset(h, 0, sizeof(Hash));
+    hash_resize(h, HASH_MIN_SIZE);
+}
+
+void hash_free(Hash *h)
+{
+    free(h->entries);
+    memset(h, 0, sizeof(Hash));
+}
+
+void *hash_get(Hash *h, uint64_t key)
+{
+    uint32_t i = hash_slot(h, key);
+
+    while (h->entries[i].value)
+    {
+        if (h->entries[i].key == key)
+        {
+            return h->entries[i].value;
+        }
+
+        i = (i + 1) & h->mask;
+    }
+
+    return NULL;
+}
+
+void hash_put(Hash *h, uint64_t key, void *value)
+{
+    uint32_t i;
+
+    assert(value != NULL);
+
+    /* keep load factor under 1/2 so probe sequences stay short */
+    if ((h->count + 1) * 2 > h->mask + 1)
+    {
+        hash_resize(h, (h->mask + 1) * 2);
+    }
+
+    i = hash_slot(h, key);
+
+    while (h->entries[i].value)
+    {
+        if (h->entries[i].key == key)
+        {
+            h->entries[i].value = value;
+            return;
+        }
+
+        i = (i + 1) & h->mask;
+    }
+
+    h->entries[i].key = key;
+    h->entries[i].value = value;
+    h->count++;
+}
+
+void *hash_remove(Hash *h, uint64_t key)
+{
+    uint32_t i = hash_slot(h, key);
+    uint32_t j;
+    void *value;
+
+    while (h->entries[i].value && h->entries[i].key != key)
+    {
+        i = (i + 1) & h->mask;
+    }
+
+    if (h->entries[i].value == NULL)
+    {
+        return NULL;
+    }
+
+    value = h->entries[i].value;
+    h->entries[i].value = NULL;
+    h->count--;
+
+    /* backward shift deletion, no tombstones needed */
+    for (j = (i + 1) & h->mask; h->entries[j].value; j = (j + 1) & h->mask)
+    {
+        uint32_t ideal = hash_slot(h, h->entries[j].key);
+
+        if (((j - ideal) & h->mask) >= ((j - i) & h->mask))
+        {
+            h->entries[i] = h->entries[j];
+            h->entries[j].value = NULL;
+            i = j;
+        }
+    }
+
+    return value;
+}
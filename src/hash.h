@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+/* open addressing hash table with linear probing, NULL values mark empty slots */
+
+typedef struct HashEntry
+{
+    uint64_t            key;
+    void                *value;
+} HashEntry;
+
+typedef struct Hash
+{
+    HashEntry           *entries;
+    uint32_t            mask;
+    uint32_t            count;
+} Hash;
+
+void hash_init(Hash *h);
+void hash_free(Hash *h);
+void *hash_get(Hash *h, uint64_t key);
+void hash_put(Hash *h, uint64_t key, void *value);
+void *hash_remove(Hash *h, uint64_t key);
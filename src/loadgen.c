@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Simulates a crowd of CnCNet clients against a server on loopback. Each
+ * client has its own socket on a distinct 127.2.0.0/16 address and speaks
+ * the wire format of dedicated.c: game broadcasts with the magic bytes of
+ * its game, direct packets to other players of the same game, ping replies
+ * and a disconnect at the end, while a separate socket floods CMD_QUERY.
+ *
+ * Payloads carry the send time so every delivered copy yields a relay
+ * latency sample, and the expected number of deliveries is known from the
+ * game membership, so lost packets are counted exactly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "net.h"
+#include "timer.h"
+
+#define LOADGEN_EVENTS  512
+#define LOADGEN_MIN_LEN 22
+
+enum
+{
+    CMD_TUNNEL,
+    CMD_P2P,
+    CMD_DISCONNECT,
+    CMD_PING,
+    CMD_QUERY,
+    CMD_TESTP2P
+};
+
+typedef struct Game
+{
+    const char          *name;
+    uint8_t             magic[6];
+    int                 members;
+} Game;
+
+static Game games[] = {
+    { "C&C95",  { 0x34, 0x12, 0x00, 0x00, 0x00, 0x00 }, 0 },
+    { "RA95",   { 0x35, 0x12, 0x00, 0x00, 0x00, 0x00 }, 0 },
+    { "TS",     { 0x00, 0x00, 0x00, 0x00, 0x35, 0x12 }, 0 },
+    { "TSDTA",  { 0x00, 0x00, 0x00, 0x00, 0x35, 0x13 }, 0 },
+    { "TSTI",   { 0x00, 0x00, 0x00, 0x00, 0x35, 0x14 }, 0 },
+    { "RA2",    { 0x00, 0x00, 0x00, 0x00, 0x36, 0x12 }, 0 },
+};
+
+#define NUM_GAMES (sizeof(games) / sizeof(games[0]))
+
+typedef struct Client
+{
+    int                 fd;
+    struct sockaddr_in  local;
+    int                 game;
+    int                 p2p;
+    int                 connected;
+    uint32_t            seq;
+} Client;
+
+static Client *clients;
+static int num_clients = 1000;
+static int *by_game[NUM_GAMES];
+static struct sockaddr_in server;
+static int epfd;
+static int query_fd = -1;
+
+/* connected with an unknown game, sees every broadcast like the welcome bot */
+static Client monitor;
+
+static uint64_t measure_start;
+static uint64_t sent_broadcast;
+static uint64_t sent_direct;
+static uint64_t sent_query;
+static uint64_t expected;
+static uint64_t delivered;
+static uint64_t pings;
+static uint64_t query_replies;
+
+static uint32_t *samples;
+static size_t num_samples;
+static size_t max_samples;
+
+static int open_socket(uint32_t ip, uint16_t port, struct sockaddr_in *local)
+{
+    socklen_t l = sizeof(struct sockaddr_in);
+    int size = 4 * 1024 * 1024;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    net_address_ex(local, ip, port);
+
+    if (bind(fd, (struct sockaddr *)local, sizeof(struct sockaddr_in)) < 0)
+    {
+        perror("bind");
+        exit(1);
+    }
+
+    getsockname(fd, (struct sockaddr *)local, &l);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void send_tunnel(Client *c, uint32_t to_ip, uint16_t to_port, int len)
+{
+    uint8_t buf[NET_BUF_SIZE];
+    uint64_t now = timer_now_us();
+    uint32_t id = c - clients;
+
+    buf[0] = c->p2p ? CMD_P2P : CMD_TUNNEL;
+    memcpy(buf + 1, &to_ip, 4);
+    memcpy(buf + 5, &to_port, 2);
+
+    /* magic bytes first so the server classifies us, then our stamp */
+    memset(buf + 7, 0, len);
+    memcpy(buf + 7, games[c->game].magic, 6);
+    memcpy(buf + 7 + 6, &now, 8);
+    memcpy(buf + 7 + 14, &id, 4);
+    memcpy(buf + 7 + 18, &c->seq, 4);
+    c->seq++;
+
+    sendto(c->fd, buf, 7 + len, 0, (struct sockaddr *)&server, sizeof(server));
+}
+
+static void send_broadcast(Client *c, int len)
+{
+    send_tunnel(c, 0xFFFFFFFF, 0xFFFF, len);
+    sent_broadcast++;
+    expected += games[c->game].members;
+}
+
+static void send_direct(Client *c, int len)
+{
+    Game *g = &games[c->game];
+    Client *to;
+
+    if (g->members < 2)
+    {
+        send_broadcast(c, len);
+        return;
+    }
+
+    do
+    {
+        to = &clients[by_game[c->game][rand() % g->members]];
+    } while (to == c);
+
+    /* p2p clients are addressed by ip and the fake port */
+    send_tunnel(c, to->local.sin_addr.s_addr, to->p2p ? htons(8054) : to->local.sin_port, len);
+    sent_direct++;
+    expected++;
+}
+
+static int drain(int timeout)
+{
+    struct epoll_event events[LOADGEN_EVENTS];
+    uint8_t buf[NET_BUF_SIZE];
+    int i, n;
+
+    n = epoll_wait(epfd, events, LOADGEN_EVENTS, timeout);
+
+    for (i = 0; i < n; i++)
+    {
+        Client *c = events[i].data.ptr;
+        int fd = c ? c->fd : query_fd;
+        ssize_t len;
+
+        while ((len = recv(fd, buf, sizeof(buf), 0)) > -1)
+        {
+            if (len == 0)
+            {
+                continue;
+            }
+
+            if ((buf[0] == CMD_TUNNEL || buf[0] == CMD_P2P) && len >= 7 + LOADGEN_MIN_LEN)
+            {
+                uint64_t stamp;
+                uint32_t id;
+
+                memcpy(&stamp, buf + 7 + 6, 8);
+                memcpy(&id, buf + 7 + 14, 4);
+
+                if (c == &monitor && id < (uint32_t)num_clients)
+                {
+                    clients[id].connected = 1;
+                }
+
+                /* late copies of the connect phase are not measured */
+                if (stamp < measure_start)
+                {
+                    continue;
+                }
+
+                delivered++;
+
+                if (num_samples == max_samples)
+                {
+                    max_samples = max_samples ? max_samples * 2 : 65536;
+                    samples = realloc(samples, max_samples * sizeof(uint32_t));
+                }
+
+                samples[num_samples++] = timer_now_us() - stamp;
+            }
+            else if (buf[0] == CMD_PING && c)
+            {
+                /* echo the ping so the server keeps us */
+                sendto(c->fd, buf, len, 0, (struct sockaddr *)&server, sizeof(server));
+                pings++;
+            }
+            else if (buf[0] == CMD_QUERY)
+            {
+                query_replies++;
+            }
+        }
+    }
+
+    return n;
+}
+
+/* until nothing has arrived for a few milliseconds */
+static void drain_idle()
+{
+    while (drain(5) > 0);
+}
+
+static void drain_for(int ms)
+{
+    uint64_t now, end = timer_now_us() + ms * 1000;
+
+    while ((now = timer_now_us()) < end)
+    {
+        drain((end - now + 999) / 1000);
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p)
+{
+    size_t i = (size_t)(p * (num_samples - 1));
+    return num_samples ? samples[i] : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char server_ip[32] = "127.0.0.1";
+    int server_port = 9001;
+    int duration = 10;
+    int rate = 0;
+    int broadcast_pct = 2;
+    int p2p_pct = 20;
+    int query_rate = 100;
+    int len = 64;
+    int opt, i, round;
+    struct rlimit rl;
+    struct epoll_event ev;
+    uint64_t start, end, now, sent = 0, queries_due = 0;
+
+    while ((opt = getopt(argc, argv, "?hs:p:n:d:r:b:P:q:l:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                strncpy(server_ip, optarg, sizeof(server_ip)-1);
+                break;
+            case 'p':
+                server_port = atoi(optarg);
+                break;
+            case 'n':
+                num_clients = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 'b':
+                broadcast_pct = atoi(optarg);
+                break;
+            case 'P':
+                p2p_pct = atoi(optarg);
+                break;
+            case 'q':
+                query_rate = atoi(optarg);
+                break;
+            case 'l':
+                len = atoi(optarg);
+                break;
+            case 'h':
+            case '?':
+            default:
+                fprintf(stderr, "Usage: %s [-h?] [-s server ip] [-p port] [-n clients] [-d seconds] [-r packets/s, 0 saturates] "
+                                "[-b broadcast %%] [-P p2p %%] [-q queries/s] [-l payload bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (num_clients < 2 || num_clients > 254 * 254)
+    {
+        fprintf(stderr, "Client count must be between 2 and %d\n", 254 * 254);
+        return 1;
+    }
+
+    if (len < LOADGEN_MIN_LEN)
+    {
+        len = LOADGEN_MIN_LEN;
+    }
+    else if (len > NET_BUF_SIZE - 7)
+    {
+        len = NET_BUF_SIZE - 7;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    net_address(&server, server_ip, server_port);
+    epfd = epoll_create1(0);
+    srand(1);
+
+    clients = calloc(num_clients, sizeof(Client));
+
+    for (i = 0; i < (int)NUM_GAMES; i++)
+    {
+        by_game[i] = calloc(num_clients, sizeof(int));
+    }
+
+    for (i = 0; i < num_clients; i++)
+    {
+        Client *c = &clients[i];
+        uint32_t ip = htonl(0x7F020000 + ((i / 254) << 8) + (i % 254) + 1);
+
+        c->game = i % NUM_GAMES;
+        c->p2p = (rand() % 100) < p2p_pct;
+        c->fd = open_socket(ip, c->p2p ? 8054 : 0, &c->local);
+
+        by_game[c->game][games[c->game].members++] = i;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    monitor.fd = open_socket(htonl(0x7F030002), 0, &monitor.local);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &monitor;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, monitor.fd, &ev);
+
+    if (query_rate > 0)
+    {
+        struct sockaddr_in local;
+        query_fd = open_socket(htonl(0x7F030001), 0, &local);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, query_fd, &ev);
+    }
+
+    printf("Simulating %d clients against %s:%d for %d seconds at %s\n",
+        num_clients, server_ip, server_port, duration, rate ? "a fixed rate" : "saturation");
+
+    /*
+     * Connect everyone with an announcing broadcast so the server knows their
+     * game. A client whose announce is dropped would join on its first direct
+     * packet with an unknown game and receive every broadcast, so announces
+     * are repeated until the monitor has seen each one.
+     */
+    while (!monitor.connected)
+    {
+        uint8_t hello[7] = { CMD_TUNNEL, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+        sendto(monitor.fd, hello, sizeof(hello), 0, (struct sockaddr *)&server, sizeof(server));
+        send_tunnel(&clients[0], 0xFFFFFFFF, 0xFFFF, len);
+        drain_for(100);
+        monitor.connected = clients[0].connected;
+    }
+
+    for (round = 0; round < 10; round++)
+    {
+        int missing = 0;
+
+        for (i = 0; i < num_clients; i++)
+        {
+            if (!clients[i].connected)
+            {
+                send_tunnel(&clients[i], 0xFFFFFFFF, 0xFFFF, len);
+
+                if ((++missing & 31) == 0)
+                {
+                    drain_idle();
+                }
+            }
+        }
+
+        if (missing == 0)
+        {
+            break;
+        }
+
+        drain_for(100);
+    }
+
+    for (i = 0; i < num_clients; i++)
+    {
+        if (!clients[i].connected)
+        {
+            fprintf(stderr, "Server did not relay the connect of every client\n");
+            return 1;
+        }
+    }
+
+    /* the connect phase is not measured */
+    expected = delivered = 0;
+    num_samples = 0;
+
+    start = measure_start = timer_now_us();
+    end = start + (uint64_t)duration * 1000000;
+
+    while ((now = timer_now_us()) < end)
+    {
+        Client *c = &clients[rand() % num_clients];
+
+        if (rate > 0)
+        {
+            uint64_t target = start + sent * 1000000 / rate;
+
+            if (now < target)
+            {
+                drain((target - now) / 1000);
+                continue;
+            }
+        }
+
+        if ((rand() % 100) < broadcast_pct)
+        {
+            send_broadcast(c, len);
+        }
+        else
+        {
+            send_direct(c, len);
+        }
+
+        sent++;
+
+        while (query_fd > -1 && queries_due < (now - start) * query_rate / 1000000)
+        {
+            uint8_t q = CMD_QUERY;
+            sendto(query_fd, &q, 1, 0, (struct sockaddr *)&server, sizeof(server));
+            queries_due++;
+            sent_query++;
+        }
+
+        if ((sent & 31) == 0)
+        {
+            drain(0);
+        }
+    }
+
+    end = timer_now_us();
+
+    /* let the tail of the relayed traffic arrive */
+    drain_for(500);
+
+    for (i = 0; i < num_clients; i++)
+    {
+        uint8_t d = CMD_DISCONNECT;
+        sendto(clients[i].fd, &d, 1, 0, (struct sockaddr *)&server, sizeof(server));
+    }
+
+    {
+        uint8_t d = CMD_DISCONNECT;
+        sendto(monitor.fd, &d, 1, 0, (struct sockaddr *)&server, sizeof(server));
+    }
+
+    qsort(samples, num_samples, sizeof(uint32_t), cmp_u32);
+
+    {
+        double secs = (end - start) / 1e6;
+        uint64_t in = sent_broadcast + sent_direct + sent_query + pings;
+        uint64_t out = delivered + query_replies;
+
+        printf("       sent: %llu broadcasts, %llu direct, %llu queries, %llu ping replies\n",
+            (unsigned long long)sent_broadcast, (unsigned long long)sent_direct, (unsigned long long)sent_query, (unsigned long long)pings);
+        printf("  delivered: %llu of %llu expected, %llu lost (%.3f%%)\n",
+            (unsigned long long)delivered, (unsigned long long)expected,
+            (unsigned long long)(expected > delivered ? expected - delivered : 0),
+            expected ? (expected > delivered ? expected - delivered : 0) * 100.0 / expected : 0.0);
+        printf("    queries: %llu answered of %llu\n", (unsigned long long)query_replies, (unsigned long long)sent_query);
+        printf("     server: %.0f p/s in, %.0f p/s out, %.0f p/s total\n", in / secs, out / secs, (in + out) / secs);
+        printf("    latency: p50 %u us, p99 %u us, p999 %u us, max %u us\n",
+            percentile(0.5), percentile(0.99), percentile(0.999), percentile(1.0));
+    }
+
+    return 0;
+}
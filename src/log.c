@@ -15,14 +15,568 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef WIN32
+    #include <pthread.h>
+#endif
 
 #include "log.h"
 
+/* records in flight, power of two */
+#define LOG_RING        1024
+#define LOG_LINE        256
+/* lines written per second before the rest are only counted */
+#define LOG_BURST       20
+#define LOG_IDLE_NS     10000000
+
 static char status_line[256] = { 0 };
 
+#ifndef WIN32
+
+/*
+ * Records go through a bounded ring that any thread can push to without a
+ * lock, each slot carries a sequence number telling whether it is free for
+ * the producer at that position or ready for the writer thread. When the
+ * ring is full the record is dropped and counted, logging never waits.
+ *
+ * The caller only walks the format to copy its arguments into the record,
+ * strings included since they rarely outlive the call, the writer thread
+ * does the formatting and stamps the time when it picks the record up.
+ */
+#define LOG_ARGS        8
+#define LOG_SPEC        32
+
+typedef union LogArg
+{
+    long long           i;
+    unsigned long long  u;
+    double              d;
+    const void          *p;
+    size_t              s;      /* offset of a string in text */
+} LogArg;
+
+typedef struct LogRecord
+{
+    uint64_t            seq;
+    const char          *fmt;   /* NULL when text already is the whole line */
+    LogArg              args[LOG_ARGS];
+    char                text[LOG_LINE];
+} LogRecord;
+
+static LogRecord *ring;
+static uint64_t ring_head;
+static uint64_t ring_tail;
+static uint64_t ring_dropped;
+
+static pthread_t log_thread;
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char status_pending[256];
+static int status_dirty;
+static volatile int running;
+
+/* writer thread state */
+static char cur_line[LOG_LINE];
+static char last_line[LOG_LINE];
+static uint64_t last_repeats;
+static time_t window;
+static int window_lines;
+static uint64_t window_suppressed;
+
+/* one conversion of a format, enough of it to both pack and print its argument */
+typedef struct LogSpec
+{
+    const char          *start;
+    size_t              len;        /* from the % through the conversion */
+    char                conv;
+    char                mod[3];     /* length modifier as written */
+} LogSpec;
+
+static const char *log_spec(const char *fmt, LogSpec *spec)
+{
+    const char *p = fmt + 1;
+    int m = 0;
+
+    spec->start = fmt;
+    memset(spec->mod, 0, sizeof(spec->mod));
+
+    while (*p && strchr("-+ #0123456789.", *p))
+    {
+        p++;
+    }
+
+    while (*p && strchr("hlLjzt", *p) && m < 2)
+    {
+        spec->mod[m++] = *p++;
+    }
+
+    spec->conv = *p;
+    spec->len = *p ? p + 1 - fmt : p - fmt;
+    return *p ? p + 1 : p;
+}
+
+/* copies the arguments of fmt, returns -1 for anything the writer couldn't print from a copy */
+static int log_pack(LogRecord *r, const char *fmt, va_list args)
+{
+    size_t text = 0;
+    int n = 0;
+    LogSpec spec;
+
+    while ((fmt = strchr(fmt, '%')) != NULL)
+    {
+        fmt = log_spec(fmt, &spec);
+
+        if (spec.conv == '%')
+        {
+            continue;
+        }
+
+        if (n == LOG_ARGS || spec.len >= LOG_SPEC || memchr(spec.start, '*', spec.len) || (spec.conv == 'c' && spec.mod[0]))
+        {
+            return -1;
+        }
+
+        switch (spec.conv)
+        {
+            case 'd': case 'i':
+                if (spec.mod[0] == 'l' && spec.mod[1] == 'l')   r->args[n].i = va_arg(args, long long);
+                else if (spec.mod[0] == 'l')                    r->args[n].i = va_arg(args, long);
+                else if (spec.mod[0] == 'z')                    r->args[n].i = va_arg(args, ssize_t);
+                else if (spec.mod[0] == 'j')                    r->args[n].i = va_arg(args, intmax_t);
+                else if (spec.mod[0] == 't')                    r->args[n].i = va_arg(args, ptrdiff_t);
+                else                                            r->args[n].i = va_arg(args, int);
+                break;
+
+            case 'u': case 'o': case 'x': case 'X': case 'c':
+                if (spec.mod[0] == 'l' && spec.mod[1] == 'l')   r->args[n].u = va_arg(args, unsigned long long);
+                else if (spec.mod[0] == 'l')                    r->args[n].u = va_arg(args, unsigned long);
+                else if (spec.mod[0] == 'z')                    r->args[n].u = va_arg(args, size_t);
+                else if (spec.mod[0] == 'j')                    r->args[n].u = va_arg(args, uintmax_t);
+                else if (spec.mod[0] == 't')                    r->args[n].u = va_arg(args, ptrdiff_t);
+                else                                            r->args[n].u = va_arg(args, unsigned int);
+                break;
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                if (spec.mod[0] == 'L')
+                {
+                    return -1;
+                }
+                r->args[n].d = va_arg(args, double);
+                break;
+
+            case 'p':
+                r->args[n].p = va_arg(args, void *);
+                break;
+
+            case 's':
+            {
+                const char *str = va_arg(args, const char *);
+                size_t len;
+
+                if (spec.mod[0] || str == NULL)
+                {
+                    return -1;
+                }
+
+                len = strlen(str);
+                if (len > sizeof(r->text) - 1 - text)
+                {
+                    len = sizeof(r->text) - 1 - text;
+                }
+
+                memcpy(r->text + text, str, len);
+                r->text[text + len] = '\0';
+                r->args[n].s = text;
+                text += len + (text + len < sizeof(r->text) - 1);
+                break;
+            }
+
+            default:
+                return -1;
+        }
+
+        n++;
+    }
+
+    return 0;
+}
+
+/* writer thread side of log_pack, each conversion is printed on its own with the modifier it was packed with */
+static void log_format(LogRecord *r, char *buf, size_t size)
+{
+    const char *fmt = r->fmt;
+    size_t pos = 0;
+    int n = 0;
+    LogSpec spec;
+
+    if (fmt == NULL)
+    {
+        snprintf(buf, size, "%s", r->text);
+        return;
+    }
+
+    buf[0] = '\0';
+
+    while (*fmt && pos < size - 1)
+    {
+        const char *next = strchr(fmt, '%');
+        char one[LOG_SPEC];
+        size_t len;
+        int ret = 0;
+
+        len = next ? (size_t)(next - fmt) : strlen(fmt);
+        if (len > size - 1 - pos)
+        {
+            len = size - 1 - pos;
+        }
+
+        memcpy(buf + pos, fmt, len);
+        pos += len;
+        buf[pos] = '\0';
+
+        if (next == NULL)
+        {
+            break;
+        }
+
+        fmt = log_spec(next, &spec);
+
+        if (spec.conv == '%')
+        {
+            if (pos < size - 1)
+            {
+                buf[pos++] = '%';
+                buf[pos] = '\0';
+            }
+            continue;
+        }
+
+        memcpy(one, spec.start, spec.len);
+        one[spec.len] = '\0';
+
+        switch (spec.conv)
+        {
+            case 'd': case 'i':
+                /* promoted back to what the modifier says so hh and h still truncate */
+                if (spec.mod[0] == 'h' && spec.mod[1] == 'h')   ret = snprintf(buf + pos, size - pos, one, (signed char)r->args[n].i);
+                else if (spec.mod[0] == 'h')                    ret = snprintf(buf + pos, size - pos, one, (short)r->args[n].i);
+                else if (spec.mod[0] == 'l' && spec.mod[1] == 'l') ret = snprintf(buf + pos, size - pos, one, r->args[n].i);
+                else if (spec.mod[0] == 'l')                    ret = snprintf(buf + pos, size - pos, one, (long)r->args[n].i);
+                else if (spec.mod[0] == 'z')                    ret = snprintf(buf + pos, size - pos, one, (ssize_t)r->args[n].i);
+                else if (spec.mod[0] == 'j')                    ret = snprintf(buf + pos, size - pos, one, (intmax_t)r->args[n].i);
+                else if (spec.mod[0] == 't')                    ret = snprintf(buf + pos, size - pos, one, (ptrdiff_t)r->args[n].i);
+                else                                            ret = snprintf(buf + pos, size - pos, one, (int)r->args[n].i);
+                break;
+
+            case 'u': case 'o': case 'x': case 'X': case 'c':
+                if (spec.mod[0] == 'h' && spec.mod[1] == 'h')   ret = snprintf(buf + pos, size - pos, one, (unsigned char)r->args[n].u);
+                else if (spec.mod[0] == 'h')                    ret = snprintf(buf + pos, size - pos, one, (unsigned short)r->args[n].u);
+                else if (spec.mod[0] == 'l' && spec.mod[1] == 'l') ret = snprintf(buf + pos, size - pos, one, r->args[n].u);
+                else if (spec.mod[0] == 'l')                    ret = snprintf(buf + pos, size - pos, one, (unsigned long)r->args[n].u);
+                else if (spec.mod[0] == 'z')                    ret = snprintf(buf + pos, size - pos, one, (size_t)r->args[n].u);
+                else if (spec.mod[0] == 'j')                    ret = snprintf(buf + pos, size - pos, one, (uintmax_t)r->args[n].u);
+                else if (spec.mod[0] == 't')                    ret = snprintf(buf + pos, size - pos, one, (ptrdiff_t)r->args[n].u);
+                else                                            ret = snprintf(buf + pos, size - pos, one, (unsigned int)r->args[n].u);
+                break;
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                ret = snprintf(buf + pos, size - pos, one, r->args[n].d);
+                break;
+
+            case 'p':
+                ret = snprintf(buf + pos, size - pos, one, r->args[n].p);
+                break;
+
+            case 's':
+                ret = snprintf(buf + pos, size - pos, one, r->text + r->args[n].s);
+                break;
+        }
+
+        n++;
+
+        if (ret > 0)
+        {
+            pos += (size_t)ret < size - pos ? (size_t)ret : size - 1 - pos;
+        }
+    }
+}
+
+static int log_push(const char *fmt, va_list args)
+{
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    LogRecord *r;
+    va_list copy;
+
+    for (;;)
+    {
+        int64_t diff;
+
+        r = &ring[pos & (LOG_RING - 1)];
+        diff = (int64_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* the format outlives the call, callers pass literals */
+    r->fmt = fmt;
+
+    va_copy(copy, args);
+    if (log_pack(r, fmt, copy) < 0)
+    {
+        /* something like %* or %Lf that can't be packed is formatted here as before */
+        r->fmt = NULL;
+        vsnprintf(r->text, sizeof(r->text), fmt, args);
+    }
+    va_end(copy);
+
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void log_line(time_t when, const char *line)
+{
+    char tbuf[256];
+    struct tm *tm = localtime(&when);
+
+    if (tm)
+    {
+        strftime(tbuf, sizeof(tbuf), "[%c] ", tm);
+        fputs(tbuf, stdout);
+    }
+
+    fputs(line, stdout);
+}
+
+static void log_repeats(time_t now)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "last message repeated %llu times\n", (unsigned long long)last_repeats);
+    log_line(now, buf);
+    last_repeats = 0;
+}
+
+/* a second has passed, report what was held back during it */
+static void log_window(time_t now)
+{
+    char buf[64];
+
+    if (last_repeats > 0)
+    {
+        log_repeats(now);
+    }
+
+    if (window_suppressed > 0)
+    {
+        snprintf(buf, sizeof(buf), "%llu messages suppressed\n", (unsigned long long)window_suppressed);
+        log_line(now, buf);
+        window_suppressed = 0;
+    }
+
+    window = now;
+    window_lines = 0;
+}
+
+static void log_record(LogRecord *r, time_t when)
+{
+    if (when != window)
+    {
+        log_window(when);
+    }
+
+    log_format(r, cur_line, sizeof(cur_line));
+
+    if (strcmp(cur_line, last_line) == 0)
+    {
+        last_repeats++;
+        return;
+    }
+
+    if (last_repeats > 0)
+    {
+        log_repeats(when);
+    }
+
+    if (window_lines >= LOG_BURST)
+    {
+        window_suppressed++;
+        return;
+    }
+
+    strcpy(last_line, cur_line);
+    window_lines++;
+    log_line(when, cur_line);
+}
+
+static int log_drain()
+{
+    int count = 0;
+    uint64_t dropped;
+    /* records are picked up within LOG_IDLE_NS of being pushed, close enough for a timestamp in seconds */
+    time_t now = time(NULL);
+
+    for (;;)
+    {
+        LogRecord *r = &ring[ring_tail & (LOG_RING - 1)];
+
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+        {
+            break;
+        }
+
+        if (count++ == 0)
+        {
+            log_status_clear();
+        }
+
+        log_record(r, now);
+
+        __atomic_store_n(&r->seq, ring_tail + LOG_RING, __ATOMIC_RELEASE);
+        ring_tail++;
+    }
+
+    dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        window_suppressed += dropped;
+    }
+
+    if (window != 0 && window != now && (last_repeats > 0 || window_suppressed > 0))
+    {
+        if (count++ == 0)
+        {
+            log_status_clear();
+        }
+
+        log_window(now);
+    }
+
+    pthread_mutex_lock(&status_mutex);
+    if (status_dirty)
+    {
+        strcpy(status_line, status_pending);
+        status_dirty = 0;
+        count++;
+    }
+    pthread_mutex_unlock(&status_mutex);
+
+    if (count > 0)
+    {
+        fprintf(stdout, "\r%s", status_line);
+        fflush(stdout);
+    }
+
+    return count;
+}
+
+static void *log_loop(void *arg)
+{
+    struct timespec idle = { 0, LOG_IDLE_NS };
+
+    while (running)
+    {
+        if (log_drain() == 0)
+        {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    log_drain();
+
+    return NULL;
+}
+
+int log_init()
+{
+    int i;
+
+    if (running)
+    {
+        return 0;
+    }
+
+    ring = calloc(LOG_RING, sizeof(LogRecord));
+    if (ring == NULL)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < LOG_RING; i++)
+    {
+        ring[i].seq = i;
+    }
+
+    ring_head = ring_tail = ring_dropped = 0;
+    last_line[0] = '\0';
+    last_repeats = 0;
+    window = 0;
+
+    running = 1;
+
+    if (pthread_create(&log_thread, NULL, log_loop, NULL) != 0)
+    {
+        running = 0;
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void log_free()
+{
+    if (!running)
+    {
+        return;
+    }
+
+    running = 0;
+    pthread_join(log_thread, NULL);
+
+    /* whatever was still held back */
+    log_status_clear();
+    log_window(time(NULL));
+    log_statusf(NULL);
+
+    free(ring);
+    ring = NULL;
+}
+
+#else
+
+int log_init()
+{
+    return 0;
+}
+
+void log_free()
+{
+}
+
+#endif
+
 int log_printf(const char *fmt, ...)
 {
     va_list args;
@@ -30,6 +584,16 @@ int log_printf(const char *fmt, ...)
     time_t now;
     struct tm *tm;
 
+#ifndef WIN32
+    if (running)
+    {
+        va_start(args, fmt);
+        log_push(fmt, args);
+        va_end(args);
+        return 0;
+    }
+#endif
+
     now = time(NULL);
     tm = localtime(&now);
 
@@ -55,6 +619,20 @@ int log_statusf(const char *fmt, ...)
 {
     va_list args;
 
+#ifndef WIN32
+    /* the writer thread redraws it */
+    if (running && fmt != NULL)
+    {
+        pthread_mutex_lock(&status_mutex);
+        va_start(args, fmt);
+        vsnprintf(status_pending, sizeof(status_pending), fmt, args);
+        va_end(args);
+        status_dirty = 1;
+        pthread_mutex_unlock(&status_mutex);
+        return 0;
+    }
+#endif
+
     if (fmt != NULL)
     {
         status_line[0] = '\0';
@@ -78,4 +656,3 @@ void log_status_clear()
         fputc(' ', stdout);
     fputc('\r', stdout);
 }
-
@@ -14,6 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* after log_init messages are written by a background thread, identical ones are coalesced and at most a
+ * burst per second gets through, log_free writes out the rest. The thread also does the formatting so fmt
+ * has to outlive the call, a string literal */
+int log_init();
+void log_free();
+
 int log_printf(const char *fmt, ...);
 int log_statusf(const char *fmt, ...);
 void log_status_clear();
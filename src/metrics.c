@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "net.h"
+#include "metrics.h"
+
+#ifndef WIN32
+    #include <fcntl.h>
+#endif
+
+/* scrapes are served a bit at a time as their sockets get ready, never waited for on the relay thread */
+#define METRICS_CONNS       4
+/* a scrape that takes longer than this is dropped, in milliseconds */
+#define METRICS_TIMEOUT     1000
+
+typedef struct MetricsConn
+{
+    int                 fd;
+    uint64_t            since;
+    char                req[1024];
+    size_t              req_len;
+    char                *resp;      /* NULL while the request is still coming in */
+    size_t              resp_len;
+    size_t              sent;
+} MetricsConn;
+
+static MetricsConn conns[METRICS_CONNS];
+static char *body;
+static size_t body_size;
+
+static void metrics_nonblock(int fd)
+{
+#ifdef WIN32
+    u_long yes = 1;
+    ioctlsocket(fd, FIONBIO, &yes);
+#else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+static int metrics_would_block()
+{
+#ifdef WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+int metrics_open(int port)
+{
+    struct sockaddr_in addr;
+    int fd, i, yes = 1;
+
+    for (i = 0; i < METRICS_CONNS; i++)
+    {
+        conns[i].fd = -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &yes, sizeof(yes));
+
+    /* never exposed beyond loopback, put a proxy in front if it needs to be */
+    net_address_ex(&addr, htonl(INADDR_LOOPBACK), port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    metrics_nonblock(fd);
+    return fd;
+}
+
+static void conn_close(MetricsConn *c)
+{
+    net_unwatch(c->fd);
+    close(c->fd);
+    free(c->resp);
+    memset(c, 0, sizeof(MetricsConn));
+    c->fd = -1;
+}
+
+/* whatever the request was, everyone gets the same answer once it is in, the body is rendered right then */
+static void conn_respond(MetricsConn *c, MetricsRender render, uint64_t now)
+{
+    char head[256];
+    size_t len;
+    int head_len;
+
+    len = render(body, body_size, now);
+    if (len >= body_size)
+    {
+        char *grown = realloc(body, len + 1024);
+
+        if (grown == NULL)
+        {
+            conn_close(c);
+            return;
+        }
+
+        body = grown;
+        body_size = len + 1024;
+        len = render(body, body_size, now);
+        len = len < body_size ? len : body_size - 1;
+    }
+
+    head_len = snprintf(head, sizeof(head),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %u\r\n"
+        "Connection: close\r\n"
+        "\r\n", (unsigned int)len);
+
+    c->resp = malloc(head_len + len);
+    if (c->resp == NULL)
+    {
+        conn_close(c);
+        return;
+    }
+
+    memcpy(c->resp, head, head_len);
+    memcpy(c->resp + head_len, body, len);
+    c->resp_len = head_len + len;
+    c->sent = 0;
+    net_watch_write(c->fd);
+}
+
+static void conn_io(MetricsConn *c, MetricsRender render, uint64_t now)
+{
+    int ret;
+
+    if (c->resp == NULL)
+    {
+        ret = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+
+        if (ret < 0 && metrics_would_block())
+        {
+            return;
+        }
+
+        if (ret < 0 || (ret == 0 && c->req_len == 0))
+        {
+            conn_close(c);
+            return;
+        }
+
+        c->req_len += ret;
+        c->req[c->req_len] = '\0';
+
+        /* read it all so closing doesn't reset the connection, a request too long to hold is answered anyway */
+        if (ret > 0 && strstr(c->req, "\r\n\r\n") == NULL && c->req_len < sizeof(c->req) - 1)
+        {
+            return;
+        }
+
+        conn_respond(c, render, now);
+        if (c->fd < 0)
+        {
+            return;
+        }
+    }
+
+    while (c->sent < c->resp_len)
+    {
+        ret = send(c->fd, c->resp + c->sent, c->resp_len - c->sent, 0);
+
+        if (ret < 0 && metrics_would_block())
+        {
+            return;
+        }
+
+        if (ret <= 0)
+        {
+            break;
+        }
+
+        c->sent += ret;
+    }
+
+    shutdown(c->fd, 1);
+    conn_close(c);
+}
+
+void metrics_poll(int fd, MetricsRender render, uint64_t now)
+{
+    MetricsConn *c;
+    int i, s;
+
+    if (net_ready(fd))
+    {
+        while ((s = accept(fd, NULL, NULL)) > -1)
+        {
+            for (c = NULL, i = 0; i < METRICS_CONNS && c == NULL; i++)
+            {
+                c = conns[i].fd < 0 ? &conns[i] : NULL;
+            }
+
+            if (c == NULL)
+            {
+                close(s);
+                continue;
+            }
+
+            metrics_nonblock(s);
+            memset(c, 0, sizeof(MetricsConn));
+            c->fd = s;
+            c->since = now;
+            net_watch(s);
+        }
+    }
+
+    for (i = 0; i < METRICS_CONNS; i++)
+    {
+        c = &conns[i];
+
+        if (c->fd < 0)
+        {
+            continue;
+        }
+
+        if (now - c->since > METRICS_TIMEOUT)
+        {
+            conn_close(c);
+        }
+        else if (net_ready(c->fd))
+        {
+            conn_io(c, render, now);
+        }
+    }
+}
+
+void metrics_close(int fd)
+{
+    int i;
+
+    /* the slots are only valid once metrics_open ran */
+    if (fd < 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < METRICS_CONNS; i++)
+    {
+        if (conns[i].fd > -1)
+        {
+            conn_close(&conns[i]);
+        }
+    }
+
+    free(body);
+    body = NULL;
+    body_size = 0;
+
+    close(fd);
+}
@@ -14,24 +14,88 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifndef WIN32
+    /* recvmmsg(2) and sendmmsg(2) */
+    #define _GNU_SOURCE
+#endif
+
 #include "net.h"
 #include "log.h"
+#include "hash.h"
+#include "timer.h"
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <linux/io_uring.h>
+#endif
+
+/* the io_uring backend needs multishot recvmsg and provided buffer rings, kernel headers 6.0 or newer */
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+    #define NET_URING
+#endif
+
 #include <string.h>
 
-static struct sockaddr_in net_local;
-static uint8_t net_ibuf[NET_BUF_SIZE];
-static uint8_t net_obuf[NET_BUF_SIZE];
-static uint32_t net_ipos;
-static uint32_t net_ilen;
-static uint32_t net_opos;
-int net_socket = 0;
+/* the context of each thread backs the net_ functions without one, the peer registry is shared */
+NET_TLS NetCtx net_default = { .osnap = -1 };
 int net_open = 0;
 
+/* inbound traffic capture, see net.h for the format */
+static FILE *net_capture;
+
+/* extra descriptors waited on together with the socket */
+#define NET_WATCH_MAX 16
+
+#ifdef NET_URING
+static NET_TLS int net_uring_fd = -1;
+static int net_uring_pending();
+#endif
+
+#ifdef __linux__
+static NET_TLS int net_epoll = -1;
+static NET_TLS struct epoll_event net_events[NET_WATCH_MAX + 1];
+static NET_TLS int net_nevents;
+#else
+static NET_TLS int net_watched[NET_WATCH_MAX];
+static NET_TLS uint8_t net_watched_out[NET_WATCH_MAX];
+static NET_TLS int net_nwatched;
+static NET_TLS fd_set net_rfds;
+static NET_TLS fd_set net_wfds;
+#endif
+
+/* peers live in chunks of cache line aligned slots that are never moved, the
+ * user data follows the slot header and free slots are chained by index */
+#define NET_PEER_CHUNK  1024
+#define NET_PEER_ALIGN  64
+
+typedef struct NetPeer
+{
+    struct sockaddr_in  addr;
+    int32_t             index;
+    int32_t             next;
+    int32_t             ip_next;
+    uint8_t             used;
+} NetPeer;
+
+#define NET_PEER_HDR    ((sizeof(NetPeer) + 15) & ~15)
+
+static uint8_t **net_peer_chunks;
+static void **net_peer_chunks_raw;
+static int net_peer_nchunks;
+static int net_peer_max;
+static int net_peer_used;
+static int net_peer_top;
+static int net_peer_free = NET_PEER_NONE;
+static size_t net_peer_stride;
+static Hash net_peer_by_addr;
+static Hash net_peer_by_ip;
+
 int net_opt_reuse(uint16_t sock)
 {
     int yes = 1;
@@ -39,6 +103,34 @@ int net_opt_reuse(uint16_t sock)
     return yes;
 }
 
+int net_opt_reuseport(int sock)
+{
+    int yes = 1;
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *) &yes, sizeof(yes));
+#endif
+    return yes;
+}
+
+/* have the kernel poll the device for this long on a receive instead of waiting for an interrupt */
+int net_opt_busypoll(int sock, int usec)
+{
+#ifdef SO_BUSY_POLL
+    int yes = 1;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (char *) &usec, sizeof(usec)) < 0)
+    {
+        return -1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char *) &yes, sizeof(yes));
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 int net_opt_broadcast(uint16_t sock)
 {
     int yes = 1;
@@ -68,19 +160,190 @@ void net_address_ex(struct sockaddr_in *addr, uint32_t ip, uint16_t port)
     addr->sin_port = htons(port);
 }
 
+static void net_ctx_reset(NetCtx *ctx)
+{
+    ctx->ibuf = ctx->rbuf[0];
+    ctx->ipos = ctx->ilen = 0;
+    ctx->rcount = ctx->rnext = 0;
+    ctx->opos = 0;
+    ctx->tcount = 0;
+    ctx->tpos = 0;
+    ctx->osnap = -1;
+}
+
 int net_init()
 {
 #ifdef WIN32
     WSADATA wsaData;
     WSAStartup(0x0101, &wsaData);
 #endif
+    net_ctx_reset(&net_default);
     net_socket = socket(AF_INET, SOCK_DGRAM, 0);
+
+#ifdef __linux__
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = net_socket;
+        net_epoll = epoll_create1(0);
+        epoll_ctl(net_epoll, EPOLL_CTL_ADD, net_socket, &ev);
+    }
+#endif
+
     return net_socket;
 }
 
-void net_free()
+int net_watch(int fd)
+{
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(net_epoll, EPOLL_CTL_ADD, fd, &ev);
+#else
+    if (net_nwatched == NET_WATCH_MAX)
+    {
+        return -1;
+    }
+
+    net_watched_out[net_nwatched] = 0;
+    net_watched[net_nwatched++] = fd;
+    return 0;
+#endif
+}
+
+/* wait for room to write on a watched descriptor instead of something to read */
+int net_watch_write(int fd)
+{
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    return epoll_ctl(net_epoll, EPOLL_CTL_MOD, fd, &ev);
+#else
+    int i;
+
+    for (i = 0; i < net_nwatched; i++)
+    {
+        if (net_watched[i] == fd)
+        {
+            net_watched_out[i] = 1;
+            return 0;
+        }
+    }
+
+    return -1;
+#endif
+}
+
+int net_unwatch(int fd)
+{
+#ifdef __linux__
+    return epoll_ctl(net_epoll, EPOLL_CTL_DEL, fd, NULL);
+#else
+    int i;
+
+    for (i = 0; i < net_nwatched; i++)
+    {
+        if (net_watched[i] == fd)
+        {
+            net_nwatched--;
+            net_watched[i] = net_watched[net_nwatched];
+            net_watched_out[i] = net_watched_out[net_nwatched];
+            return 0;
+        }
+    }
+
+    return -1;
+#endif
+}
+
+int net_wait(int timeout)
+{
+#ifdef NET_URING
+    /* completions already there, only look at the other descriptors */
+    if (net_uring_fd > -1 && net_uring_pending())
+    {
+        timeout = 0;
+    }
+#endif
+#ifdef __linux__
+    net_nevents = epoll_wait(net_epoll, net_events, NET_WATCH_MAX + 1, timeout);
+    return net_nevents;
+#else
+    struct timeval tv;
+    int i, max = net_socket;
+
+    FD_ZERO(&net_rfds);
+    FD_ZERO(&net_wfds);
+    FD_SET(net_socket, &net_rfds);
+
+    for (i = 0; i < net_nwatched; i++)
+    {
+        FD_SET(net_watched[i], net_watched_out[i] ? &net_wfds : &net_rfds);
+        if (net_watched[i] > max)
+        {
+            max = net_watched[i];
+        }
+    }
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    return select(max + 1, &net_rfds, &net_wfds, NULL, &tv);
+#endif
+}
+
+int net_ready(int fd)
+{
+#ifdef __linux__
+    int i;
+
+#ifdef NET_URING
+    if (net_uring_fd > -1 && fd == net_socket)
+    {
+        return net_uring_pending();
+    }
+#endif
+
+    for (i = 0; i < net_nevents; i++)
+    {
+        if (net_events[i].data.fd == fd)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+#else
+    return FD_ISSET(fd, &net_rfds) || FD_ISSET(fd, &net_wfds);
+#endif
+}
+
+void net_close()
 {
+    net_uring_free();
+#ifdef __linux__
+    close(net_epoll);
+    net_epoll = -1;
+#endif
     close(net_socket);
+    net_socket = 0;
+}
+
+void net_free()
+{
+    net_close();
+
+    if (net_peer_by_addr.entries)
+    {
+        net_peer_reset();
+        hash_free(&net_peer_by_addr);
+        hash_free(&net_peer_by_ip);
+    }
 
 #ifdef WIN32
     WSACleanup();
@@ -94,149 +357,1368 @@ int net_bind(const char *ip, int port)
         return 0;
     }
 
-    net_address(&net_local, ip, port);
+    net_address(&net_default.local, ip, port);
     net_opt_reuse(net_socket);
     net_opt_broadcast(net_socket);
 
-    return bind(net_socket, (struct sockaddr *)&net_local, sizeof(net_local));
+    return bind(net_socket, (struct sockaddr *)&net_default.local, sizeof(net_default.local));
+}
+
+/* take over a socket bound by another process in place of the one from net_init */
+int net_adopt(int sock)
+{
+    socklen_t len = sizeof(net_default.local);
+
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    epoll_ctl(net_epoll, EPOLL_CTL_DEL, net_socket, NULL);
+    epoll_ctl(net_epoll, EPOLL_CTL_ADD, sock, &ev);
+#endif
+
+    close(net_socket);
+    net_socket = sock;
+
+    return getsockname(net_socket, (struct sockaddr *)&net_default.local, &len);
+}
+
+uint32_t net_ctx_read_size(NetCtx *ctx)
+{
+    return ctx->ilen - ctx->ipos;
 }
 
 uint32_t net_read_size()
 {
-    return net_ilen - net_ipos;
+    return net_ctx_read_size(&net_default);
 }
 
-int8_t net_read_int8()
+int8_t net_ctx_read_int8(NetCtx *ctx)
 {
     int8_t tmp;
-    if (net_ipos + 1 > net_ilen)
+    if (ctx->ipos + 1 > ctx->ilen)
         return 0;
-    memcpy(&tmp, net_ibuf + net_ipos, 1);
-    net_ipos += 1;
+    memcpy(&tmp, ctx->ibuf + ctx->ipos, 1);
+    ctx->ipos += 1;
     return tmp;
 }
 
-int16_t net_read_int16()
+int8_t net_read_int8()
+{
+    return net_ctx_read_int8(&net_default);
+}
+
+int16_t net_ctx_read_int16(NetCtx *ctx)
 {
     int16_t tmp;
-    if (net_ipos + 2 > net_ilen)
+    if (ctx->ipos + 2 > ctx->ilen)
         return 0;
-    memcpy(&tmp, net_ibuf + net_ipos, 2);
-    net_ipos += 2;
+    memcpy(&tmp, ctx->ibuf + ctx->ipos, 2);
+    ctx->ipos += 2;
     return tmp;
 }
 
-int32_t net_read_int32()
+int16_t net_read_int16()
+{
+    return net_ctx_read_int16(&net_default);
+}
+
+int32_t net_ctx_read_int32(NetCtx *ctx)
 {
     int32_t tmp;
-    if (net_ipos + 4 > net_ilen)
+    if (ctx->ipos + 4 > ctx->ilen)
         return 0;
-    memcpy(&tmp, net_ibuf + net_ipos, 4);
-    net_ipos += 4;
+    memcpy(&tmp, ctx->ibuf + ctx->ipos, 4);
+    ctx->ipos += 4;
     return tmp;
 }
 
-int net_read_data(void *ptr, size_t len)
+int32_t net_read_int32()
+{
+    return net_ctx_read_int32(&net_default);
+}
+
+int net_ctx_read_data(NetCtx *ctx, void *ptr, size_t len)
 {
-    if (net_ipos + len > net_ilen)
+    if (ctx->ipos + len > ctx->ilen)
     {
-        len = net_ilen - net_ipos;
+        len = ctx->ilen - ctx->ipos;
     }
 
-    memcpy(ptr, net_ibuf + net_ipos, len);
-    net_ipos += len;
+    memcpy(ptr, ctx->ibuf + ctx->ipos, len);
+    ctx->ipos += len;
     return len;
 }
 
-int net_read_string(char *str, size_t len)
+int net_read_data(void *ptr, size_t len)
+{
+    return net_ctx_read_data(&net_default, ptr, len);
+}
+
+void *net_ctx_read_ptr(NetCtx *ctx, size_t *len)
+{
+    void *ptr = ctx->ibuf + ctx->ipos;
+    *len = ctx->ilen - ctx->ipos;
+    ctx->ipos = ctx->ilen;
+    return ptr;
+}
+
+void *net_read_ptr(size_t *len)
+{
+    return net_ctx_read_ptr(&net_default, len);
+}
+
+int net_ctx_read_string(NetCtx *ctx, char *str, size_t len)
 {
     int i;
-    for (i = net_ipos; i < NET_BUF_SIZE; i++)
-        if (net_ibuf[i] == '\0')
+    for (i = ctx->ipos; i < NET_BUF_SIZE; i++)
+        if (ctx->ibuf[i] == '\0')
             break;
 
-    if (len > i - net_ipos)
+    if (len > i - ctx->ipos)
     {
-        len = i - net_ipos;
+        len = i - ctx->ipos;
     }
 
-    memcpy(str, net_ibuf + net_ipos, len);
+    memcpy(str, ctx->ibuf + ctx->ipos, len);
     str[len] = '\0';
-    net_ipos += len + 1;
+    ctx->ipos += len + 1;
     return 0;
 }
 
+int net_read_string(char *str, size_t len)
+{
+    return net_ctx_read_string(&net_default, str, len);
+}
+
+int net_ctx_write_int8(NetCtx *ctx, int8_t d)
+{
+    assert(ctx->opos + 1 <= NET_BUF_SIZE);
+    memcpy(ctx->obuf + ctx->opos, &d, 1);
+    ctx->opos += 1;
+    return 1;
+}
+
 int net_write_int8(int8_t d)
 {
-    assert(net_opos + 1 <= NET_BUF_SIZE);
-    memcpy(net_obuf + net_opos, &d, 1);
-    net_opos += 1;
+    return net_ctx_write_int8(&net_default, d);
+}
+
+int net_ctx_write_int16(NetCtx *ctx, int16_t d)
+{
+    int16_t tmp = d;
+    assert(ctx->opos + 2 <= NET_BUF_SIZE);
+    memcpy(ctx->obuf + ctx->opos, &tmp, 2);
+    ctx->opos += 2;
     return 1;
 }
 
 int net_write_int16(int16_t d)
 {
-    int16_t tmp = d;
-    assert(net_opos + 2 <= NET_BUF_SIZE);
-    memcpy(net_obuf + net_opos, &tmp, 2);
-    net_opos += 2;
+    return net_ctx_write_int16(&net_default, d);
+}
+
+int net_ctx_write_int32(NetCtx *ctx, int32_t d)
+{
+    int32_t tmp = d;
+    assert(ctx->opos + 4 <= NET_BUF_SIZE);
+    memcpy(ctx->obuf + ctx->opos, &tmp, 4);
+    ctx->opos += 4;
     return 1;
 }
 
 int net_write_int32(int32_t d)
 {
-    int32_t tmp = d;
-    assert(net_opos + 4 <= NET_BUF_SIZE);
-    memcpy(net_obuf + net_opos, &tmp, 4);
-    net_opos += 4;
+    return net_ctx_write_int32(&net_default, d);
+}
+
+int net_ctx_write_data(NetCtx *ctx, void *ptr, size_t len)
+{
+    assert(ctx->opos + len <= NET_BUF_SIZE);
+    memcpy(ctx->obuf + ctx->opos, ptr, len);
+    ctx->opos += len;
     return 1;
 }
 
 int net_write_data(void *ptr, size_t len)
 {
-    assert(net_opos + len <= NET_BUF_SIZE);
-    memcpy(net_obuf + net_opos, ptr, len);
-    net_opos += len;
+    return net_ctx_write_data(&net_default, ptr, len);
+}
+
+int net_ctx_write_string(NetCtx *ctx, char *str)
+{
+    assert(ctx->opos + strlen(str) + 1 <= NET_BUF_SIZE);
+    memcpy(ctx->obuf + ctx->opos, str, strlen(str) + 1);
+    ctx->opos += strlen(str) + 1;
     return 1;
 }
 
 int net_write_string(char *str)
 {
-    assert(net_opos + strlen(str) + 1 <= NET_BUF_SIZE);
-    memcpy(net_obuf + net_opos, str, strlen(str) + 1);
-    net_opos += strlen(str) + 1;
-    return 1;
+    return net_ctx_write_string(&net_default, str);
 }
 
-int net_write_string_int32(int32_t d)
+int net_ctx_write_string_int32(NetCtx *ctx, int32_t d)
 {
     char str[32];
     snprintf(str, sizeof(str), "%d", d);
-    return net_write_string(str);
+    return net_ctx_write_string(ctx, str);
 }
 
-int net_recv(struct sockaddr_in *src)
+int net_write_string_int32(int32_t d)
 {
-    socklen_t l = sizeof(struct sockaddr_in);
-    net_ipos = 0;
-    net_ilen = recvfrom(net_socket, net_ibuf, NET_BUF_SIZE, 0, (struct sockaddr *)src, &l);
-    return net_ilen;
+    return net_ctx_write_string_int32(&net_default, d);
 }
 
-int net_send(struct sockaddr_in *dst)
+int net_capture_open(const char *path)
 {
-    int ret = net_send_noflush(dst);
-    net_send_discard();
-    return ret;
+    net_capture = fopen(path, "wb");
+
+    if (net_capture == NULL)
+    {
+        return -1;
+    }
+
+    fwrite(NET_CAPTURE_MAGIC, 1, 8, net_capture);
+    return 0;
 }
 
-int net_send_noflush(struct sockaddr_in *dst)
+void net_capture_close()
+{
+    if (net_capture)
+    {
+        fclose(net_capture);
+        net_capture = NULL;
+    }
+}
+
+static void net_capture_write(uint64_t ts, struct sockaddr_in *src, const uint8_t *buf, uint32_t len)
+{
+    uint8_t rec[sizeof(NetCaptureRecord) + NET_BUF_SIZE];
+    NetCaptureRecord *hdr = (NetCaptureRecord *)rec;
+
+    hdr->ts = ts;
+    hdr->ip = src->sin_addr.s_addr;
+    hdr->port = src->sin_port;
+    hdr->len = len;
+    memcpy(rec + sizeof(NetCaptureRecord), buf, len);
+
+    /* a single write per record keeps records whole when several workers capture */
+    fwrite(rec, 1, sizeof(NetCaptureRecord) + len, net_capture);
+}
+
+#ifdef NET_URING
+
+/*
+ * io_uring backend. A multishot recvmsg stays posted on the socket and picks
+ * its buffers from a ring of provided buffers, so receiving costs no syscall
+ * of its own. A received buffer is handed to the relay as is and given back
+ * to the kernel on the next receive, after the sends referring to it have
+ * completed. Sends are submitted as one batch of sendmsg entries per flush
+ * and waited for in the same io_uring_enter.
+ */
+#define NET_URING_SQ        512
+#define NET_URING_CQ        4096
+#define NET_URING_BUFS      256
+#define NET_URING_BUF       (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + NET_BUF_SIZE)
+#define NET_URING_RECV      1
+#define NET_URING_SEND      2
+#define NET_URING_CANCEL    3
+
+typedef struct NetUringCqe
 {
-    int ret = sendto(net_socket, net_obuf, net_opos, 0, (struct sockaddr *)dst, sizeof(struct sockaddr_in));
+    int32_t             res;
+    uint32_t            flags;
+} NetUringCqe;
+
+static NET_TLS uint8_t *net_uring_ring;
+static NET_TLS size_t net_uring_ring_size;
+static NET_TLS struct io_uring_sqe *net_uring_sqes;
+static NET_TLS size_t net_uring_sqes_size;
+static NET_TLS uint32_t *net_uring_sq_head;
+static NET_TLS uint32_t *net_uring_sq_tail;
+static NET_TLS uint32_t net_uring_sq_mask;
+static NET_TLS uint32_t net_uring_sq_entries;
+static NET_TLS uint32_t net_uring_sq_local;
+static NET_TLS uint32_t net_uring_sq_queued;
+static NET_TLS uint32_t *net_uring_cq_head;
+static NET_TLS uint32_t *net_uring_cq_tail;
+static NET_TLS uint32_t net_uring_cq_mask;
+static NET_TLS struct io_uring_cqe *net_uring_cqes;
+
+static NET_TLS struct io_uring_buf_ring *net_uring_br;
+static NET_TLS uint16_t net_uring_br_tail;
+static NET_TLS uint8_t *net_uring_pool;
+static NET_TLS uint16_t net_uring_held[NET_BATCH_MAX];
+static NET_TLS int net_uring_nheld;
+
+static NET_TLS struct msghdr net_uring_rmsg;
+static NET_TLS int net_uring_armed;
+static NET_TLS int net_uring_stopped;
+static NET_TLS NetUringCqe net_uring_ready[NET_URING_BUFS * 2];
+static NET_TLS int net_uring_rhead;
+static NET_TLS int net_uring_rtail;
+static NET_TLS int net_uring_inflight;
+static NET_TLS struct msghdr net_uring_smsg[NET_QUEUE_MAX];
+static NET_TLS struct iovec net_uring_siov[NET_QUEUE_MAX];
+
+static int net_uring_enter(uint32_t submit, uint32_t complete, uint32_t flags)
+{
+    return syscall(__NR_io_uring_enter, net_uring_fd, submit, complete, flags, NULL, 0);
+}
+
+static int net_uring_submit(uint32_t complete)
+{
+    int ret;
+
+    __atomic_store_n(net_uring_sq_tail, net_uring_sq_local, __ATOMIC_RELEASE);
+    ret = net_uring_enter(net_uring_sq_queued, complete, complete ? IORING_ENTER_GETEVENTS : 0);
+
+    if (ret > -1)
+    {
+        net_uring_sq_queued -= ret;
+    }
+
     return ret;
 }
 
-void net_send_discard()
+static struct io_uring_sqe *net_uring_sqe()
+{
+    struct io_uring_sqe *sqe;
+    uint32_t head = __atomic_load_n(net_uring_sq_head, __ATOMIC_ACQUIRE);
+
+    if (net_uring_sq_local - head >= net_uring_sq_entries)
+    {
+        net_uring_submit(0);
+        head = __atomic_load_n(net_uring_sq_head, __ATOMIC_ACQUIRE);
+
+        if (net_uring_sq_local - head >= net_uring_sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    sqe = &net_uring_sqes[net_uring_sq_local & net_uring_sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    net_uring_sq_local++;
+    net_uring_sq_queued++;
+    return sqe;
+}
+
+static void net_uring_buf_put(uint16_t bid)
+{
+    struct io_uring_buf *b = &net_uring_br->bufs[net_uring_br_tail & (NET_URING_BUFS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(net_uring_pool + (size_t)bid * NET_URING_BUF);
+    b->len = NET_URING_BUF;
+    b->bid = bid;
+    net_uring_br_tail++;
+}
+
+static void net_uring_buf_publish()
+{
+    __atomic_store_n(&net_uring_br->tail, net_uring_br_tail, __ATOMIC_RELEASE);
+}
+
+static int net_uring_arm()
+{
+    struct io_uring_sqe *sqe = net_uring_sqe();
+
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    memset(&net_uring_rmsg, 0, sizeof(net_uring_rmsg));
+    net_uring_rmsg.msg_namelen = sizeof(struct sockaddr_in);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = net_socket;
+    sqe->addr = (uint64_t)(uintptr_t)&net_uring_rmsg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = NET_URING_RECV;
+
+    net_uring_armed = 1;
+    return net_uring_submit(0);
+}
+
+/* move completions off the ring, receives are kept in order for net_recv_batch */
+static int net_uring_reap()
+{
+    uint32_t head = *net_uring_cq_head;
+    uint32_t tail = __atomic_load_n(net_uring_cq_tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    for (; head != tail; head++, count++)
+    {
+        struct io_uring_cqe *cqe = &net_uring_cqes[head & net_uring_cq_mask];
+
+        if (cqe->user_data == NET_URING_SEND)
+        {
+            net_uring_inflight--;
+            continue;
+        }
+
+        if (cqe->user_data == NET_URING_CANCEL)
+        {
+            continue;
+        }
+
+        /* the multishot receive ended, usually when it ran out of buffers */
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            net_uring_armed = 0;
+        }
+
+        net_uring_ready[net_uring_rtail % (NET_URING_BUFS * 2)].res = cqe->res;
+        net_uring_ready[net_uring_rtail % (NET_URING_BUFS * 2)].flags = cqe->flags;
+        net_uring_rtail++;
+    }
+
+    __atomic_store_n(net_uring_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+static int net_uring_pending()
+{
+    return net_uring_rhead != net_uring_rtail
+        || *net_uring_cq_head != __atomic_load_n(net_uring_cq_tail, __ATOMIC_ACQUIRE);
+}
+
+void net_uring_free()
+{
+    if (net_uring_fd < 0)
+    {
+        return;
+    }
+
+#ifdef __linux__
+    if (net_epoll > -1)
+    {
+        epoll_ctl(net_epoll, EPOLL_CTL_DEL, net_uring_fd, NULL);
+        net_watch(net_socket);
+    }
+#endif
+
+    close(net_uring_fd);
+    net_uring_fd = -1;
+
+    if (net_uring_ring)
+    {
+        munmap(net_uring_ring, net_uring_ring_size);
+        net_uring_ring = NULL;
+    }
+
+    if (net_uring_sqes)
+    {
+        munmap(net_uring_sqes, net_uring_sqes_size);
+        net_uring_sqes = NULL;
+    }
+
+    if (net_uring_br)
+    {
+        munmap(net_uring_br, NET_URING_BUFS * sizeof(struct io_uring_buf));
+        net_uring_br = NULL;
+    }
+
+    free(net_uring_pool);
+    net_uring_pool = NULL;
+    net_uring_nheld = 0;
+    net_uring_rhead = net_uring_rtail = 0;
+    net_uring_inflight = 0;
+    net_uring_armed = 0;
+    net_uring_stopped = 0;
+}
+
+/* cancels the receive and waits for its last completion, what it took off the socket is still there for net_recv_batch */
+void net_uring_stop()
+{
+    struct io_uring_sqe *sqe;
+
+    if (net_uring_fd < 0)
+    {
+        return;
+    }
+
+    net_uring_stopped = 1;
+    net_uring_reap();
+
+    if (!net_uring_armed || (sqe = net_uring_sqe()) == NULL)
+    {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = NET_URING_RECV;
+    sqe->user_data = NET_URING_CANCEL;
+
+    while (net_uring_armed)
+    {
+        if (net_uring_submit(1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        net_uring_reap();
+    }
+}
+
+int net_uring_init()
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    int i;
+
+    if (net_uring_fd > -1)
+    {
+        return 0;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = NET_URING_CQ;
+
+    net_uring_fd = syscall(__NR_io_uring_setup, NET_URING_SQ, &p);
+    if (net_uring_fd < 0)
+    {
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        net_uring_free();
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    net_uring_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    net_uring_ring = mmap(NULL, net_uring_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, net_uring_fd, IORING_OFF_SQ_RING);
+    net_uring_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    net_uring_sqes = mmap(NULL, net_uring_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, net_uring_fd, IORING_OFF_SQES);
+
+    if (net_uring_ring == MAP_FAILED || net_uring_sqes == MAP_FAILED)
+    {
+        net_uring_ring = net_uring_ring == MAP_FAILED ? NULL : net_uring_ring;
+        net_uring_sqes = net_uring_sqes == MAP_FAILED ? NULL : net_uring_sqes;
+        net_uring_free();
+        return -1;
+    }
+
+    net_uring_sq_head = (uint32_t *)(net_uring_ring + p.sq_off.head);
+    net_uring_sq_tail = (uint32_t *)(net_uring_ring + p.sq_off.tail);
+    net_uring_sq_mask = *(uint32_t *)(net_uring_ring + p.sq_off.ring_mask);
+    net_uring_sq_entries = p.sq_entries;
+    net_uring_sq_local = *net_uring_sq_tail;
+    net_uring_sq_queued = 0;
+    net_uring_cq_head = (uint32_t *)(net_uring_ring + p.cq_off.head);
+    net_uring_cq_tail = (uint32_t *)(net_uring_ring + p.cq_off.tail);
+    net_uring_cq_mask = *(uint32_t *)(net_uring_ring + p.cq_off.ring_mask);
+    net_uring_cqes = (struct io_uring_cqe *)(net_uring_ring + p.cq_off.cqes);
+
+    /* the index array never changes, slot i always points at sqe i */
+    for (i = 0; i < p.sq_entries; i++)
+    {
+        ((uint32_t *)(net_uring_ring + p.sq_off.array))[i] = i;
+    }
+
+    /* provided buffers, the ring itself has to be page aligned */
+    net_uring_br = mmap(NULL, NET_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    net_uring_pool = malloc(NET_URING_BUFS * NET_URING_BUF);
+
+    if (net_uring_br == MAP_FAILED || net_uring_pool == NULL)
+    {
+        net_uring_br = net_uring_br == MAP_FAILED ? NULL : net_uring_br;
+        net_uring_free();
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)net_uring_br;
+    reg.ring_entries = NET_URING_BUFS;
+    reg.bgid = 0;
+
+    if (syscall(__NR_io_uring_register, net_uring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        net_uring_free();
+        return -1;
+    }
+
+    net_uring_br_tail = 0;
+    for (i = 0; i < NET_URING_BUFS; i++)
+    {
+        net_uring_buf_put(i);
+    }
+    net_uring_buf_publish();
+
+    if (net_uring_arm() < 0)
+    {
+        net_uring_free();
+        return -1;
+    }
+
+    /* an opcode or flag the kernel does not know fails right at submission */
+    net_uring_reap();
+    if (net_uring_rhead != net_uring_rtail && net_uring_ready[net_uring_rhead].res < 0 && net_uring_ready[net_uring_rhead].res != -ENOBUFS)
+    {
+        net_uring_free();
+        return -1;
+    }
+
+#ifdef __linux__
+    /* wake up on completions instead of socket readiness */
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = net_uring_fd;
+        epoll_ctl(net_epoll, EPOLL_CTL_DEL, net_socket, NULL);
+        epoll_ctl(net_epoll, EPOLL_CTL_ADD, net_uring_fd, &ev);
+    }
+#endif
+
+    return 0;
+}
+
+int net_uring_enabled()
+{
+    return net_uring_fd > -1;
+}
+
+static void net_uring_release()
+{
+    int i;
+
+    if (net_uring_nheld == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < net_uring_nheld; i++)
+    {
+        net_uring_buf_put(net_uring_held[i]);
+    }
+
+    net_uring_nheld = 0;
+    net_uring_buf_publish();
+}
+
+static int net_uring_recv_batch(int max)
+{
+    int count = 0, dropped = 0;
+    uint16_t bid;
+
+    /* the previous batch may still be referenced by queued sends */
+    if (net_default.tcount > 0)
+    {
+        net_ctx_flush(&net_default);
+    }
+
+    net_uring_release();
+    net_uring_reap();
+
+    while (count < max && net_uring_rhead != net_uring_rtail)
+    {
+        NetUringCqe *c = &net_uring_ready[net_uring_rhead % (NET_URING_BUFS * 2)];
+        struct io_uring_recvmsg_out *out;
+        uint8_t *buf;
+
+        net_uring_rhead++;
+
+        if (!(c->flags & IORING_CQE_F_BUFFER))
+        {
+            continue;
+        }
+
+        bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = net_uring_pool + (size_t)bid * NET_URING_BUF;
+        out = (struct io_uring_recvmsg_out *)buf;
+
+        /* dropped datagrams don't count towards max, their buffers go straight back so only a batch is ever held */
+        if (c->res < 0 || out->namelen < sizeof(struct sockaddr_in) || (out->flags & MSG_TRUNC))
+        {
+            net_uring_buf_put(bid);
+            dropped++;
+            continue;
+        }
+
+        net_uring_held[net_uring_nheld++] = bid;
+
+        memcpy(&net_default.raddr[count], buf + sizeof(struct io_uring_recvmsg_out), sizeof(struct sockaddr_in));
+        net_default.rptr[count] = buf + sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + out->controllen;
+        net_default.rlen[count] = out->payloadlen;
+        count++;
+    }
+
+    if (dropped > 0)
+    {
+        net_uring_buf_publish();
+    }
+
+    if (!net_uring_armed && !net_uring_stopped && net_uring_rhead == net_uring_rtail)
+    {
+        /* buffers of this batch come back on the next call, rearm with what is free now */
+        net_uring_arm();
+    }
+
+    if (net_capture)
+    {
+        uint64_t ts = timer_now_us();
+        int i;
+
+        for (i = 0; i < count; i++)
+        {
+            net_capture_write(ts, &net_default.raddr[i], net_default.rptr[i], net_default.rlen[i]);
+        }
+    }
+
+    net_default.rcount = count;
+    return count;
+}
+
+static int net_uring_flush()
+{
+    int i, sent = 0;
+
+    for (i = 0; i < net_default.tcount; i++)
+    {
+        struct io_uring_sqe *sqe;
+
+        /* a full submission queue is handed to the kernel and retried, waiting on a send if that's what it takes */
+        while ((sqe = net_uring_sqe()) == NULL)
+        {
+            if (net_uring_submit(net_uring_inflight > 0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+            {
+                break;
+            }
+
+            net_uring_reap();
+        }
+
+        if (sqe == NULL)
+        {
+            /* the ring is broken, this one still goes out */
+            sendto(net_socket, net_default.tqueue[i].buf, net_default.tqueue[i].len, 0,
+                (struct sockaddr *)&net_default.tqueue[i].addr, sizeof(struct sockaddr_in));
+            sent++;
+            continue;
+        }
+
+        net_uring_siov[i].iov_base = (void *)net_default.tqueue[i].buf;
+        net_uring_siov[i].iov_len = net_default.tqueue[i].len;
+        memset(&net_uring_smsg[i], 0, sizeof(struct msghdr));
+        net_uring_smsg[i].msg_name = &net_default.tqueue[i].addr;
+        net_uring_smsg[i].msg_namelen = sizeof(struct sockaddr_in);
+        net_uring_smsg[i].msg_iov = &net_uring_siov[i];
+        net_uring_smsg[i].msg_iovlen = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = net_socket;
+        sqe->addr = (uint64_t)(uintptr_t)&net_uring_smsg[i];
+        sqe->len = 1;
+        sqe->user_data = NET_URING_SEND;
+
+        net_uring_inflight++;
+        sent++;
+    }
+
+    /* the queued buffers are reused after this, so every send has to be done with them */
+    while (net_uring_inflight > 0)
+    {
+        if (net_uring_submit(net_uring_inflight) < 0 && errno != EINTR && errno != EBUSY)
+        {
+            break;
+        }
+
+        net_uring_reap();
+    }
+
+    net_default.tcount = 0;
+    net_default.tpos = 0;
+    net_default.osnap = -1;
+    return sent;
+}
+
+#else
+
+int net_uring_init()
+{
+    return -1;
+}
+
+void net_uring_free()
+{
+}
+
+void net_uring_stop()
+{
+}
+
+int net_uring_enabled()
+{
+    return 0;
+}
+
+#endif
+
+int net_ctx_recv(NetCtx *ctx, struct sockaddr_in *src)
+{
+    socklen_t l = sizeof(struct sockaddr_in);
+    ctx->rcount = ctx->rnext = 0;
+    ctx->ibuf = ctx->rbuf[0];
+    ctx->ipos = 0;
+    ctx->ilen = recvfrom(ctx->sock, ctx->ibuf, NET_BUF_SIZE, 0, (struct sockaddr *)src, &l);
+
+    if (net_capture && (int)ctx->ilen > -1)
+    {
+        net_capture_write(timer_now_us(), src, ctx->ibuf, ctx->ilen);
+    }
+
+    return ctx->ilen;
+}
+
+int net_recv(struct sockaddr_in *src)
+{
+    return net_ctx_recv(&net_default, src);
+}
+
+int net_ctx_recv_batch(NetCtx *ctx, int max)
+{
+#ifdef __linux__
+    static int unsupported = 0;
+    struct mmsghdr msgs[NET_BATCH_MAX];
+    struct iovec iovs[NET_BATCH_MAX];
+    int i, ret;
+#endif
+
+    if (max > NET_BATCH_MAX)
+    {
+        max = NET_BATCH_MAX;
+    }
+
+    ctx->rcount = ctx->rnext = 0;
+
+#ifdef NET_URING
+    /* io_uring only serves the socket of the thread */
+    if (ctx == &net_default && net_uring_fd > -1)
+    {
+        return net_uring_recv_batch(max);
+    }
+#endif
+
+#ifdef __linux__
+    if (max > 1 && !unsupported)
+    {
+        memset(msgs, 0, sizeof(struct mmsghdr) * max);
+
+        for (i = 0; i < max; i++)
+        {
+            iovs[i].iov_base = ctx->rbuf[i];
+            iovs[i].iov_len = NET_BUF_SIZE;
+            msgs[i].msg_hdr.msg_name = &ctx->raddr[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = recvmmsg(ctx->sock, msgs, max, MSG_DONTWAIT, NULL);
+
+        if (ret > -1)
+        {
+            for (i = 0; i < ret; i++)
+            {
+                ctx->rlen[i] = msgs[i].msg_len;
+                ctx->rptr[i] = ctx->rbuf[i];
+            }
+
+            if (net_capture)
+            {
+                uint64_t ts = timer_now_us();
+
+                for (i = 0; i < ret; i++)
+                {
+                    net_capture_write(ts, &ctx->raddr[i], ctx->rbuf[i], ctx->rlen[i]);
+                }
+            }
+
+            ctx->rcount = ret;
+            return ret;
+        }
+
+        if (errno != ENOSYS)
+        {
+            return ret;
+        }
+
+        unsupported = 1;
+    }
+#endif
+
+    /* single packet fallback */
+    if (net_ctx_recv(ctx, &ctx->raddr[0]) < 0)
+    {
+        return -1;
+    }
+
+    ctx->rlen[0] = ctx->ilen;
+    ctx->rptr[0] = ctx->rbuf[0];
+    ctx->rcount = 1;
+    return 1;
+}
+
+int net_recv_batch(int max)
+{
+    return net_ctx_recv_batch(&net_default, max);
+}
+
+void net_ctx_recv_set(NetCtx *ctx, void *buf, size_t len)
+{
+    ctx->ibuf = buf;
+    ctx->ilen = len;
+    ctx->ipos = 0;
+}
+
+void net_recv_set(void *buf, size_t len)
+{
+    net_ctx_recv_set(&net_default, buf, len);
+}
+
+void *net_ctx_recv_buf(NetCtx *ctx, size_t *len)
+{
+    *len = ctx->ilen;
+    return ctx->ibuf;
+}
+
+void *net_recv_buf(size_t *len)
+{
+    return net_ctx_recv_buf(&net_default, len);
+}
+
+int net_ctx_recv_next(NetCtx *ctx, struct sockaddr_in *src)
+{
+    if (ctx->rnext >= ctx->rcount)
+    {
+        return -1;
+    }
+
+    memcpy(src, &ctx->raddr[ctx->rnext], sizeof(struct sockaddr_in));
+    ctx->ibuf = ctx->rptr[ctx->rnext];
+    ctx->ilen = ctx->rlen[ctx->rnext];
+    ctx->ipos = 0;
+    ctx->rnext++;
+    return ctx->ilen;
+}
+
+int net_recv_next(struct sockaddr_in *src)
+{
+    return net_ctx_recv_next(&net_default, src);
+}
+
+int net_ctx_send(NetCtx *ctx, struct sockaddr_in *dst)
+{
+    int ret = net_ctx_send_noflush(ctx, dst);
+    net_ctx_send_discard(ctx);
+    return ret;
+}
+
+int net_send(struct sockaddr_in *dst)
+{
+    return net_ctx_send(&net_default, dst);
+}
+
+int net_ctx_send_noflush(NetCtx *ctx, struct sockaddr_in *dst)
+{
+    int ret = sendto(ctx->sock, ctx->obuf, ctx->opos, 0, (struct sockaddr *)dst, sizeof(struct sockaddr_in));
+    return ret;
+}
+
+int net_send_noflush(struct sockaddr_in *dst)
+{
+    return net_ctx_send_noflush(&net_default, dst);
+}
+
+void *net_ctx_send_buf(NetCtx *ctx, size_t *len)
+{
+    *len = ctx->opos;
+    return ctx->obuf;
+}
+
+void *net_send_buf(size_t *len)
+{
+    return net_ctx_send_buf(&net_default, len);
+}
+
+void net_ctx_send_discard(NetCtx *ctx)
+{
+    ctx->opos = 0;
+    ctx->osnap = -1;
+}
+
+void net_send_discard()
+{
+    net_ctx_send_discard(&net_default);
+}
+
+static void net_ctx_queue_add(NetCtx *ctx, const void *buf, size_t len, struct sockaddr_in *dst)
+{
+    NetQueued *q = &ctx->tqueue[ctx->tcount++];
+    q->buf = buf;
+    q->len = len;
+    memcpy(&q->addr, dst, sizeof(struct sockaddr_in));
+}
+
+int net_ctx_queue(NetCtx *ctx, struct sockaddr_in *dst)
+{
+    if (ctx->tcount == NET_QUEUE_MAX)
+    {
+        net_ctx_flush(ctx);
+    }
+
+    /* the output buffer is copied aside once and shared by every destination until discarded */
+    if (ctx->osnap < 0)
+    {
+        if (ctx->tpos + ctx->opos > sizeof(ctx->tbuf))
+        {
+            net_ctx_flush(ctx);
+        }
+
+        memcpy(ctx->tbuf + ctx->tpos, ctx->obuf, ctx->opos);
+        ctx->osnap = ctx->tpos;
+        ctx->tpos += ctx->opos;
+    }
+
+    net_ctx_queue_add(ctx, ctx->tbuf + ctx->osnap, ctx->opos, dst);
+    return ctx->opos;
+}
+
+int net_queue(struct sockaddr_in *dst)
+{
+    return net_ctx_queue(&net_default, dst);
+}
+
+int net_ctx_queue_data(NetCtx *ctx, const void *buf, size_t len, struct sockaddr_in *dst)
+{
+    /* the output buffer is reused right away, it gets the same treatment as net_queue */
+    if (buf == ctx->obuf && len == ctx->opos)
+    {
+        return net_ctx_queue(ctx, dst);
+    }
+
+    if (ctx->tcount == NET_QUEUE_MAX)
+    {
+        net_ctx_flush(ctx);
+    }
+
+    net_ctx_queue_add(ctx, buf, len, dst);
+    return len;
+}
+
+int net_queue_data(const void *buf, size_t len, struct sockaddr_in *dst)
+{
+    return net_ctx_queue_data(&net_default, buf, len, dst);
+}
+
+int net_ctx_flush(NetCtx *ctx)
+{
+    int i = 0, sent = 0;
+#ifdef __linux__
+    static int unsupported = 0;
+    struct mmsghdr msgs[NET_QUEUE_MAX];
+    struct iovec iovs[NET_QUEUE_MAX];
+    int ret;
+#endif
+
+#ifdef NET_URING
+    if (ctx == &net_default && net_uring_fd > -1)
+    {
+        return net_uring_flush();
+    }
+#endif
+
+#ifdef __linux__
+    if (!unsupported && ctx->tcount > 1)
+    {
+        memset(msgs, 0, sizeof(struct mmsghdr) * ctx->tcount);
+
+        for (i = 0; i < ctx->tcount; i++)
+        {
+            iovs[i].iov_base = (void *)ctx->tqueue[i].buf;
+            iovs[i].iov_len = ctx->tqueue[i].len;
+            msgs[i].msg_hdr.msg_name = &ctx->tqueue[i].addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        i = 0;
+        while (i < ctx->tcount)
+        {
+            ret = sendmmsg(ctx->sock, msgs + i, ctx->tcount - i, 0);
+
+            if (ret < 0)
+            {
+                if (errno == ENOSYS)
+                {
+                    unsupported = 1;
+                    break;
+                }
+
+                /* skip the datagram the kernel refused and carry on with the rest */
+                i++;
+                continue;
+            }
+
+            i += ret;
+            sent += ret;
+        }
+    }
+#endif
+
+    /* one sendto per datagram fallback */
+    for (; i < ctx->tcount; i++)
+    {
+        if (sendto(ctx->sock, (const char *)ctx->tqueue[i].buf, ctx->tqueue[i].len, 0, (struct sockaddr *)&ctx->tqueue[i].addr, sizeof(struct sockaddr_in)) > -1)
+        {
+            sent++;
+        }
+    }
+
+    ctx->tcount = 0;
+    ctx->tpos = 0;
+    ctx->osnap = -1;
+    return sent;
+}
+
+int net_flush()
+{
+    return net_ctx_flush(&net_default);
+}
+
+void net_broadcast(int from)
+{
+    int i;
+    for (i = net_peer_next(NET_PEER_NONE); i != NET_PEER_NONE; i = net_peer_next(i))
+    {
+        if (i != from)
+        {
+            net_send_noflush(net_peer_get(i));
+        }
+    }
+}
+
+static uint64_t net_peer_key(uint32_t ip, uint16_t port)
+{
+    return ((uint64_t)ip << 16) | port;
+}
+
+static NetPeer *net_peer_slot(int index)
+{
+    return (NetPeer *)(net_peer_chunks[index / NET_PEER_CHUNK] + (index % NET_PEER_CHUNK) * net_peer_stride);
+}
+
+void net_peer_init(int max, size_t data_size)
+{
+    if (net_peer_by_addr.entries == NULL)
+    {
+        hash_init(&net_peer_by_addr);
+        hash_init(&net_peer_by_ip);
+    }
+
+    net_peer_reset();
+    net_peer_max = max;
+    net_peer_stride = (NET_PEER_HDR + data_size + NET_PEER_ALIGN - 1) & ~(NET_PEER_ALIGN - 1);
+}
+
+void net_peer_reset()
+{
+    int i;
+
+    for (i = 0; i < net_peer_nchunks; i++)
+    {
+        free(net_peer_chunks_raw[i]);
+    }
+
+    free(net_peer_chunks);
+    free(net_peer_chunks_raw);
+    net_peer_chunks = NULL;
+    net_peer_chunks_raw = NULL;
+    net_peer_nchunks = 0;
+    net_peer_used = 0;
+    net_peer_top = 0;
+    net_peer_free = NET_PEER_NONE;
+
+    if (net_peer_by_addr.entries)
+    {
+        hash_free(&net_peer_by_addr);
+        hash_free(&net_peer_by_ip);
+        hash_init(&net_peer_by_addr);
+        hash_init(&net_peer_by_ip);
+    }
+}
+
+static int net_peer_alloc()
+{
+    int index;
+
+    if (net_peer_free != NET_PEER_NONE)
+    {
+        index = net_peer_free;
+        net_peer_free = net_peer_slot(index)->next;
+        return index;
+    }
+
+    if (net_peer_top == net_peer_nchunks * NET_PEER_CHUNK)
+    {
+        size_t size = NET_PEER_CHUNK * net_peer_stride;
+        void *raw = malloc(size + NET_PEER_ALIGN);
+
+        if (raw == NULL)
+        {
+            return NET_PEER_NONE;
+        }
+
+        net_peer_chunks = realloc(net_peer_chunks, (net_peer_nchunks + 1) * sizeof(uint8_t *));
+        net_peer_chunks_raw = realloc(net_peer_chunks_raw, (net_peer_nchunks + 1) * sizeof(void *));
+        assert(net_peer_chunks != NULL && net_peer_chunks_raw != NULL);
+
+        net_peer_chunks_raw[net_peer_nchunks] = raw;
+        net_peer_chunks[net_peer_nchunks] = (uint8_t *)(((uintptr_t)raw + NET_PEER_ALIGN - 1) & ~(uintptr_t)(NET_PEER_ALIGN - 1));
+        memset(net_peer_chunks[net_peer_nchunks], 0, size);
+        net_peer_nchunks++;
+    }
+
+    return net_peer_top++;
+}
+
+int net_peer_add(struct sockaddr_in *peer)
+{
+    NetPeer *slot;
+    int index = net_peer_get_by_addr(peer);
+
+    if (index != NET_PEER_NONE)
+    {
+        return index;
+    }
+
+    if (net_peer_max > 0 && net_peer_used >= net_peer_max)
+    {
+        return NET_PEER_NONE;
+    }
+
+    index = net_peer_alloc();
+    if (index == NET_PEER_NONE)
+    {
+        return NET_PEER_NONE;
+    }
+
+    slot = net_peer_slot(index);
+    memset(slot, 0, net_peer_stride);
+    memcpy(&slot->addr, peer, sizeof(struct sockaddr_in));
+    slot->index = index;
+    slot->used = 1;
+    slot->next = NET_PEER_NONE;
+    slot->ip_next = net_peer_get_by_ip(peer->sin_addr.s_addr);
+
+    hash_put(&net_peer_by_addr, net_peer_key(peer->sin_addr.s_addr, peer->sin_port), slot);
+    hash_put(&net_peer_by_ip, peer->sin_addr.s_addr, slot);
+    net_peer_used++;
+
+    return index;
+}
+
+void net_peer_remove(int index)
+{
+    NetPeer *slot = net_peer_slot(index);
+    uint32_t ip = slot->addr.sin_addr.s_addr;
+    NetPeer *head = hash_get(&net_peer_by_ip, ip);
+
+    assert(slot->used);
+
+    hash_remove(&net_peer_by_addr, net_peer_key(ip, slot->addr.sin_port));
+
+    if (head == slot)
+    {
+        if (slot->ip_next != NET_PEER_NONE)
+        {
+            hash_put(&net_peer_by_ip, ip, net_peer_slot(slot->ip_next));
+        }
+        else
+        {
+            hash_remove(&net_peer_by_ip, ip);
+        }
+    }
+    else
+    {
+        while (head->ip_next != index)
+        {
+            head = net_peer_slot(head->ip_next);
+        }
+
+        head->ip_next = slot->ip_next;
+    }
+
+    slot->used = 0;
+    slot->next = net_peer_free;
+    net_peer_free = index;
+    net_peer_used--;
+}
+
+void net_peer_remove_by_addr(struct sockaddr_in *peer)
+{
+    int index = net_peer_get_by_addr(peer);
+
+    if (index != NET_PEER_NONE)
+    {
+        net_peer_remove(index);
+    }
+}
+
+int net_peer_count()
+{
+    return net_peer_used;
+}
+
+int net_peer_get_by_addr(struct sockaddr_in *peer)
+{
+    NetPeer *slot = hash_get(&net_peer_by_addr, net_peer_key(peer->sin_addr.s_addr, peer->sin_port));
+    return slot ? slot->index : NET_PEER_NONE;
+}
+
+int net_peer_get_by_ip(uint32_t ip)
+{
+    NetPeer *slot = hash_get(&net_peer_by_ip, ip);
+    return slot ? slot->index : NET_PEER_NONE;
+}
+
+int net_peer_next_by_ip(int index)
+{
+    return net_peer_slot(index)->ip_next;
+}
+
+int net_peer_next(int index)
+{
+    for (index++; index < net_peer_top; index++)
+    {
+        if (net_peer_slot(index)->used)
+        {
+            return index;
+        }
+    }
+
+    return NET_PEER_NONE;
+}
+
+struct sockaddr_in *net_peer_get(int index)
+{
+    return &net_peer_slot(index)->addr;
+}
+
+void *net_peer_data(int index)
 {
-    net_opos = 0;
+    return (uint8_t *)net_peer_slot(index) + NET_PEER_HDR;
 }
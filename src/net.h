@@ -30,22 +30,83 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#ifdef WIN32
+    #define NET_TLS
+#else
+    #define NET_TLS __thread
+#endif
+
 #define NET_BUF_SIZE 2048
+#define NET_BATCH_MAX 64
+#define NET_QUEUE_MAX 256
+
+/* transmit queue entry, the buffer is referenced until the queue is flushed */
+typedef struct NetQueued
+{
+    const uint8_t       *buf;
+    uint32_t            len;
+    struct sockaddr_in  addr;
+} NetQueued;
+
+/* a socket with its own receive batch, read and write cursors and transmit queue, the net_ functions
+ * without a context work on the one of the calling thread, which also owns the io_uring and epoll state */
+typedef struct NetCtx
+{
+    int                 sock;
+    struct sockaddr_in  local;
+    uint8_t             rbuf[NET_BATCH_MAX][NET_BUF_SIZE];
+    struct sockaddr_in  raddr[NET_BATCH_MAX];
+    uint32_t            rlen[NET_BATCH_MAX];
+    uint8_t             *rptr[NET_BATCH_MAX];
+    int                 rcount;
+    int                 rnext;
+    uint8_t             *ibuf;
+    uint32_t            ipos;
+    uint32_t            ilen;
+    uint8_t             obuf[NET_BUF_SIZE];
+    uint32_t            opos;
+    NetQueued           tqueue[NET_QUEUE_MAX];
+    int                 tcount;
+    uint8_t             tbuf[NET_BATCH_MAX * NET_BUF_SIZE];
+    uint32_t            tpos;
+    int32_t             osnap;      /* where the output buffer was copied to by net_queue, -1 when it wasn't */
+} NetCtx;
+
+extern NET_TLS NetCtx net_default;
+#define net_socket (net_default.sock)
 
 int net_reuse(uint16_t sock);
 int net_address(struct sockaddr_in *addr, const char *host, uint16_t port);
 void net_address_ex(struct sockaddr_in *addr, uint32_t ip, uint16_t port);
 
+int net_opt_reuseport(int sock);
+int net_opt_busypoll(int sock, int usec);
+
 int net_init();
+int net_watch(int fd);
+int net_watch_write(int fd);
+int net_unwatch(int fd);
+int net_wait(int timeout);
+int net_ready(int fd);
+void net_close();
 void net_free();
 
+/* switch the bound socket of this thread to io_uring, -1 when the kernel can't and the classic path stays */
+int net_uring_init();
+void net_uring_free();
+/* no more receives are posted, the ones already completed are still returned by net_recv_batch */
+void net_uring_stop();
+int net_uring_enabled();
+
 int net_bind(const char *ip, int port);
+int net_adopt(int sock);
 
 uint32_t net_read_size();
 int8_t net_read_int8();
 int16_t net_read_int16();
 int32_t net_read_int32();
 int net_read_data(void *, size_t);
+void *net_read_ptr(size_t *len);
 int net_read_string(char *str, size_t len);
 
 int net_write_int8(int8_t);
@@ -55,20 +116,80 @@ int net_write_data(void *, size_t);
 int net_write_string(char *str);
 int net_write_string_int32(int32_t);
 
+/* the same on an explicit context, the net_ ones above pass the one of the calling thread */
+uint32_t net_ctx_read_size(NetCtx *ctx);
+int8_t net_ctx_read_int8(NetCtx *ctx);
+int16_t net_ctx_read_int16(NetCtx *ctx);
+int32_t net_ctx_read_int32(NetCtx *ctx);
+int net_ctx_read_data(NetCtx *ctx, void *, size_t);
+void *net_ctx_read_ptr(NetCtx *ctx, size_t *len);
+int net_ctx_read_string(NetCtx *ctx, char *str, size_t len);
+
+int net_ctx_write_int8(NetCtx *ctx, int8_t);
+int net_ctx_write_int16(NetCtx *ctx, int16_t);
+int net_ctx_write_int32(NetCtx *ctx, int32_t);
+int net_ctx_write_data(NetCtx *ctx, void *, size_t);
+int net_ctx_write_string(NetCtx *ctx, char *str);
+int net_ctx_write_string_int32(NetCtx *ctx, int32_t);
+
+int net_ctx_recv(NetCtx *ctx, struct sockaddr_in *);
+int net_ctx_recv_batch(NetCtx *ctx, int max);
+int net_ctx_recv_next(NetCtx *ctx, struct sockaddr_in *src);
+void *net_ctx_recv_buf(NetCtx *ctx, size_t *len);
+void net_ctx_recv_set(NetCtx *ctx, void *buf, size_t len);
+int net_ctx_send(NetCtx *ctx, struct sockaddr_in *);
+int net_ctx_send_noflush(NetCtx *ctx, struct sockaddr_in *dst);
+void net_ctx_send_discard(NetCtx *ctx);
+void *net_ctx_send_buf(NetCtx *ctx, size_t *len);
+int net_ctx_queue(NetCtx *ctx, struct sockaddr_in *dst);
+int net_ctx_queue_data(NetCtx *ctx, const void *buf, size_t len, struct sockaddr_in *dst);
+int net_ctx_flush(NetCtx *ctx);
+
+/* capture files start with NET_CAPTURE_MAGIC followed by a record per received datagram,
+ * fields are in host byte order except for the address which is kept as received */
+#define NET_CAPTURE_MAGIC "CNCCAP\0\1"
+
+typedef struct NetCaptureRecord
+{
+    uint64_t            ts;     /* monotonic microseconds */
+    uint32_t            ip;
+    uint16_t            port;
+    uint16_t            len;
+} NetCaptureRecord;
+
+int net_capture_open(const char *path);
+void net_capture_close();
+
 int net_recv(struct sockaddr_in *);
+int net_recv_batch(int max);
+int net_recv_next(struct sockaddr_in *src);
+/* received buffers stay valid and may be queued for sending until the next receive */
+void *net_recv_buf(size_t *len);
+/* make a datagram that did not come from the socket the current one */
+void net_recv_set(void *buf, size_t len);
 int net_send(struct sockaddr_in *);
 int net_send_noflush(struct sockaddr_in *dst);
 void net_send_discard();
+void *net_send_buf(size_t *len);
+int net_queue(struct sockaddr_in *dst);
+int net_queue_data(const void *buf, size_t len, struct sockaddr_in *dst);
+int net_flush();
 void net_broadcast(int from);
 
-void net_peer_remove(uint8_t index);
+/* peer registry, fixed size slots with stable indices and per peer user data */
+#define NET_PEER_NONE -1
+
+void net_peer_init(int max, size_t data_size);
+void net_peer_remove(int index);
 void net_peer_remove_by_addr(struct sockaddr_in *peer);
-uint8_t net_peer_count();
+int net_peer_count();
 void net_peer_reset();
-uint8_t net_peer_get_by_addr(struct sockaddr_in *peer);
-uint8_t net_peer_add(struct sockaddr_in *peer);
-struct sockaddr_in *net_peer_get(uint8_t index);
-intptr_t *net_peer_data(uint8_t index);
+int net_peer_get_by_addr(struct sockaddr_in *peer);
+int net_peer_get_by_ip(uint32_t ip);
+int net_peer_next_by_ip(int index);
+int net_peer_add(struct sockaddr_in *peer);
+int net_peer_next(int index);
+struct sockaddr_in *net_peer_get(int index);
+void *net_peer_data(int index);
 
-extern int net_socket;
 extern int net_open;
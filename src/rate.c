@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rate.h"
+
+/* tokens are kept in thousandths of a packet so a millisecond of refill is never rounded away */
+#define RATE_COST   1000
+
+const char *rate_str(int class)
+{
+    switch (class)
+    {
+        case RATE_QUERY:        return "query";
+        case RATE_BROADCAST:    return "broadcast";
+        case RATE_DIRECT:       return "direct";
+        default:                return "unknown";
+    }
+}
+
+int rate_init(RateLimit *r, const int32_t *rate)
+{
+    memset(r, 0, sizeof(RateLimit));
+    memcpy(r->rate, rate, sizeof(r->rate));
+
+    if (!rate_enabled(r))
+    {
+        return 0;
+    }
+
+    r->sources = malloc(RATE_SLOTS * sizeof(RateBucket));
+    r->subnets = malloc(RATE_SLOTS * sizeof(RateBucket));
+
+    if (r->sources == NULL || r->subnets == NULL)
+    {
+        rate_free(r);
+        return -1;
+    }
+
+    /* 255.255.255.255 never sends, so it marks an unused slot */
+    memset(r->sources, 0xFF, RATE_SLOTS * sizeof(RateBucket));
+    memset(r->subnets, 0xFF, RATE_SLOTS * sizeof(RateBucket));
+
+    return 0;
+}
+
+void rate_free(RateLimit *r)
+{
+    free(r->sources);
+    free(r->subnets);
+    r->sources = NULL;
+    r->subnets = NULL;
+}
+
+int rate_enabled(RateLimit *r)
+{
+    int i;
+
+    for (i = 0; i < RATE_LAST; i++)
+    {
+        if (r->rate[i] > 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t rate_slot(uint32_t key)
+{
+    key *= 0x9E3779B1;
+    return key >> 16;
+}
+
+static RateBucket *rate_bucket(RateBucket *table, uint32_t key, int32_t scale, const int32_t *rate, uint32_t now)
+{
+    RateBucket *b = &table[rate_slot(key)];
+    uint32_t elapsed;
+    int i;
+
+    if (b->key == 0xFFFFFFFF)
+    {
+        b->key = key;
+        b->stamp = now;
+
+        for (i = 0; i < RATE_LAST; i++)
+        {
+            b->tokens[i] = rate[i] * scale * RATE_COST;
+        }
+
+        return b;
+    }
+
+    /* a colliding source keeps what is left, or two of them taking turns would both always start full */
+    b->key = key;
+
+    elapsed = now - b->stamp;
+
+    if (elapsed > 0)
+    {
+        /* a second of budget is the most that can be saved up */
+        if (elapsed > 1000)
+        {
+            elapsed = 1000;
+        }
+
+        for (i = 0; i < RATE_LAST; i++)
+        {
+            int32_t burst = rate[i] * scale * RATE_COST;
+
+            b->tokens[i] += elapsed * rate[i] * scale;
+            if (b->tokens[i] > burst)
+            {
+                b->tokens[i] = burst;
+            }
+        }
+
+        b->stamp = now;
+    }
+
+    return b;
+}
+
+/* takes a packet worth of tokens from both buckets of ip, ip is in host byte order */
+int rate_check(RateLimit *r, uint32_t ip, int class, uint64_t now)
+{
+    RateBucket *source, *subnet;
+
+    if (r->sources == NULL || r->rate[class] <= 0)
+    {
+        return RATE_PASS;
+    }
+
+    source = rate_bucket(r->sources, ip, 1, r->rate, now);
+
+    if (source->tokens[class] < RATE_COST)
+    {
+        return RATE_SHED_SOURCE;
+    }
+
+    subnet = rate_bucket(r->subnets, ip & 0xFFFFFF00, RATE_SUBNET_SCALE, r->rate, now);
+
+    if (subnet->tokens[class] < RATE_COST)
+    {
+        return RATE_SHED_SUBNET;
+    }
+
+    source->tokens[class] -= RATE_COST;
+    subnet->tokens[class] -= RATE_COST;
+
+    return RATE_PASS;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+/* token buckets per source ip and per /24, a fixed table where a colliding address takes over the slot
+ * along with the tokens left in it */
+
+#define RATE_SLOTS          65536
+/* a /24 gets this many times the budget of a single source */
+#define RATE_SUBNET_SCALE   8
+#define RATE_MAX            100000
+
+enum
+{
+    RATE_QUERY,     /* queries and p2p tests, both answered to any source */
+    RATE_BROADCAST,
+    RATE_DIRECT,
+    RATE_LAST
+};
+
+enum
+{
+    RATE_PASS,
+    RATE_SHED_SOURCE,
+    RATE_SHED_SUBNET
+};
+
+typedef struct RateBucket
+{
+    uint32_t            key;
+    uint32_t            stamp;
+    int32_t             tokens[RATE_LAST];
+} RateBucket;
+
+typedef struct RateLimit
+{
+    RateBucket          *sources;
+    RateBucket          *subnets;
+    int32_t             rate[RATE_LAST];    /* packets per second per source, 0 is unlimited */
+} RateLimit;
+
+const char *rate_str(int class);
+
+int rate_init(RateLimit *r, const int32_t *rate);
+void rate_free(RateLimit *r);
+int rate_enabled(RateLimit *r);
+int rate_check(RateLimit *r, uint32_t ip, int class, uint64_t now);
+/* the slot of a source or /24 key, for finding collisions */
+uint32_t rate_slot(uint32_t key);
@@ -0,0 +1,1173 @@
+/*
+ * Copyright (c) 2011, 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "net.h"
+#include "log.h"
+#include "timer.h"
+#include "rate.h"
+#include "relay.h"
+
+#ifndef WIN32
+    #include <sched.h>
+#endif
+
+const char *game_str(int game)
+{
+    switch (game)
+    {
+        case GAME_CNC95:    return "C&C95";
+        case GAME_RA95:     return "RA95";
+        case GAME_TS:       return "TS";
+        case GAME_TSDTA:    return "TSDTA";
+        case GAME_TSTI:     return "TSTI";
+        case GAME_RA2:      return "RA2";
+        default:            return "UNKNOWN";
+    }
+}
+
+const char *cmd_str(int cmd)
+{
+    switch (cmd)
+    {
+        case CMD_TUNNEL:        return "tunnel";
+        case CMD_P2P:           return "p2p";
+        case CMD_DISCONNECT:    return "disconnect";
+        case CMD_PING:          return "ping";
+        case CMD_QUERY:         return "query";
+        case CMD_TESTP2P:       return "testp2p";
+        default:                return "invalid";
+    }
+}
+
+const char *outcome_str(int outcome)
+{
+    switch (outcome)
+    {
+        case OUTCOME_FORWARDED:     return "forwarded";
+        case OUTCOME_UNKNOWN_DEST:  return "unknown_destination";
+        case OUTCOME_STRAY:         return "stray";
+        case OUTCOME_MAXCLIENTS:    return "maxclients";
+        case OUTCOME_MISROUTED:     return "misrouted";
+        case OUTCOME_CLUSTER:       return "cluster";
+        default:                    return "unknown";
+    }
+}
+
+/* lives in the user data of a net peer slot */
+typedef struct Client
+{
+    Timer               timer;
+    int32_t             peer;
+    uint8_t             p2p;
+    uint64_t            last_packet;
+    uint64_t            last_ping;
+    uint32_t            ping_count;
+    uint8_t             game;
+    uint8_t             sig_len;        /* bytes of sig plus one, zero until the first broadcast */
+    uint64_t            sig;            /* leading bytes of the last broadcast, the game is only looked up again when they change */
+    int32_t             group_pos;
+    uint32_t            ping_token;     /* payload of the ping waiting for its echo */
+    uint8_t             ping_pending;
+    uint32_t            pings_sent;
+    uint32_t            pings_lost;
+    uint32_t            srtt_us;        /* smoothed like tcp does, zero until the first echo */
+    uint32_t            rttvar_us;
+} Client;
+
+/* dense list of peers per game so broadcasts only visit their recipients */
+typedef struct Group
+{
+    int32_t             *members;
+    int32_t             count;
+    int32_t             size;
+} Group;
+
+/* a signature compiled to a masked compare of the leading bytes of a broadcast */
+typedef struct Matcher
+{
+    uint64_t            mask;
+    uint64_t            value;
+    uint8_t             need;           /* shorter broadcasts can't have it */
+    uint8_t             game;
+} Matcher;
+
+static const Signature builtin_signatures[] = {
+    { GAME_CNC95,   0, 2, { 0x34, 0x12 } },
+    { GAME_RA95,    0, 2, { 0x35, 0x12 } },
+    { GAME_TS,      4, 2, { 0x35, 0x12 } },
+    { GAME_TSDTA,   4, 2, { 0x35, 0x13 } },
+    { GAME_TSTI,    4, 2, { 0x35, 0x14 } },
+    { GAME_RA2,     4, 2, { 0x36, 0x12 } },
+};
+
+#define BUILTIN_SIGNATURES (sizeof(builtin_signatures) / sizeof(Signature))
+
+RelayStats relay_stats;
+
+/* counters are kept per thread so workers reading the registry together don't share a cache line,
+ * relay_stats_collect adds them up */
+#define RELAY_THREADS 64
+
+typedef struct StatsSlot
+{
+    RelayStats          stats;
+} __attribute__((aligned(64))) StatsSlot;
+
+static StatsSlot stats_slots[RELAY_THREADS];
+static int stats_used;
+static NET_TLS RelayStats *stats_mine;
+
+/* the little the read path changes besides its own client, the rate limiter and the cluster buffers */
+static int side_busy;
+
+const uint32_t rtt_bounds[RTT_BUCKETS] = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500 };
+
+static char relay_hostname[256];
+static int32_t relay_timeout;
+static int32_t relay_maxclients;
+static uint64_t booted;
+static TimerWheel timers;
+static Group groups[GAME_LAST];
+static RelayIO relay_io;
+static RelayCluster relay_cl;
+static int relay_probing;
+static RateLimit limits;
+static Signature signatures[SIGNATURE_MAX];
+static int num_signatures;
+static Matcher matchers[SIGNATURE_MAX + BUILTIN_SIGNATURES];
+static int num_matchers;
+
+/* recently missed direct destinations, a repeat miss is dropped without a lookup or a log line */
+#define MISS_SLOTS  4096
+#define MISS_TTL    5000
+
+typedef struct Miss
+{
+    uint64_t            key;
+    uint64_t            expires;
+} Miss;
+
+static Miss misses[MISS_SLOTS];
+
+/* bumped whenever something in the cached query reply changes */
+static uint32_t query_version;
+static NET_TLS uint8_t query_buf[NET_BUF_SIZE];
+static NET_TLS size_t query_len;
+static NET_TLS uint32_t query_built_version;
+static NET_TLS uint32_t query_built_uptime;
+
+static RelayStats *stats_local()
+{
+    if (stats_mine == NULL)
+    {
+        stats_mine = &stats_slots[__atomic_fetch_add(&stats_used, 1, __ATOMIC_RELAXED) % RELAY_THREADS].stats;
+    }
+
+    return stats_mine;
+}
+
+void relay_stats_collect()
+{
+    int used = __atomic_load_n(&stats_used, __ATOMIC_RELAXED);
+    uint64_t *sum = (uint64_t *)&relay_stats;
+    size_t i;
+    int t;
+
+    /* every field is a uint64_t counter */
+    memset(&relay_stats, 0, sizeof(relay_stats));
+
+    for (t = 0; t < used && t < RELAY_THREADS; t++)
+    {
+        const uint64_t *mine = (const uint64_t *)&stats_slots[t].stats;
+
+        for (i = 0; i < sizeof(RelayStats) / sizeof(uint64_t); i++)
+        {
+            sum[i] += __atomic_load_n(&mine[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void side_lock()
+{
+    while (__atomic_exchange_n(&side_busy, 1, __ATOMIC_ACQUIRE))
+    {
+#ifndef WIN32
+        sched_yield();
+#endif
+    }
+}
+
+static void side_unlock()
+{
+    __atomic_store_n(&side_busy, 0, __ATOMIC_RELEASE);
+}
+
+static void matcher_add(const Signature *sig)
+{
+    Matcher *m = &matchers[num_matchers++];
+    uint8_t mask[SIGNATURE_WINDOW], value[SIGNATURE_WINDOW];
+
+    memset(mask, 0, sizeof(mask));
+    memset(value, 0, sizeof(value));
+    memset(mask + sig->offset, 0xFF, sig->len);
+    memcpy(value + sig->offset, sig->bytes, sig->len);
+
+    memcpy(&m->mask, mask, sizeof(mask));
+    memcpy(&m->value, value, sizeof(value));
+    m->need = sig->offset + sig->len;
+    m->game = sig->game;
+}
+
+/* configured signatures come first so a mod can be told apart from the game it is based on */
+static void signatures_compile()
+{
+    int i;
+
+    num_matchers = 0;
+
+    for (i = 0; i < num_signatures; i++)
+    {
+        matcher_add(&signatures[i]);
+    }
+
+    for (i = 0; i < BUILTIN_SIGNATURES; i++)
+    {
+        matcher_add(&builtin_signatures[i]);
+    }
+}
+
+static void net_io_send(const void *buf, size_t len, struct sockaddr_in *dst)
+{
+    net_queue_data(buf, len, dst);
+}
+
+static void net_io_flush()
+{
+    net_flush();
+}
+
+void relay_init(const char *hostname, int timeout, int maxclients, RelayIO *io, uint64_t now)
+{
+    strncpy(relay_hostname, hostname, sizeof(relay_hostname) - 1);
+    relay_timeout = timeout;
+    relay_maxclients = maxclients;
+    booted = now;
+
+    if (io)
+    {
+        relay_io = *io;
+    }
+    else
+    {
+        relay_io.send = net_io_send;
+        relay_io.flush = net_io_flush;
+    }
+
+    timer_init(&timers, now);
+    net_peer_init(maxclients, sizeof(Client));
+    memset(&relay_stats, 0, sizeof(relay_stats));
+    memset(stats_slots, 0, sizeof(stats_slots));
+    memset(misses, 0, sizeof(misses));
+    memset(&relay_cl, 0, sizeof(relay_cl));
+    relay_probing = 0;
+    signatures_compile();
+    query_version++;
+}
+
+int relay_signature(const Signature *sig)
+{
+    if (num_signatures == SIGNATURE_MAX || sig->game >= GAME_LAST || sig->len == 0 || sig->offset + sig->len > SIGNATURE_WINDOW)
+    {
+        return -1;
+    }
+
+    signatures[num_signatures++] = *sig;
+    signatures_compile();
+    return 0;
+}
+
+void relay_probe(int enabled)
+{
+    relay_probing = enabled;
+}
+
+void relay_cluster(RelayCluster *cluster)
+{
+    if (cluster)
+    {
+        relay_cl = *cluster;
+    }
+    else
+    {
+        memset(&relay_cl, 0, sizeof(relay_cl));
+    }
+}
+
+void relay_free()
+{
+    int i;
+
+    for (i = 0; i < GAME_LAST; i++)
+    {
+        free(groups[i].members);
+        memset(&groups[i], 0, sizeof(Group));
+    }
+
+    rate_free(&limits);
+    net_peer_reset();
+}
+
+int relay_limit(const int32_t *rate)
+{
+    rate_free(&limits);
+    return rate_init(&limits, rate);
+}
+
+int relay_clients(int game)
+{
+    return game < 0 ? net_peer_count() : groups[game].count;
+}
+
+static Client *client_get(int peer)
+{
+    return net_peer_data(peer);
+}
+
+static Client *client_find(struct sockaddr_in *addr)
+{
+    int peer = net_peer_get_by_addr(addr);
+    return peer == NET_PEER_NONE ? NULL : client_get(peer);
+}
+
+/* the peer a direct packet to ip and port is delivered to */
+int relay_find(uint32_t ip, uint16_t port)
+{
+    struct sockaddr_in addr;
+    int peer;
+
+    net_address_ex(&addr, ip, ntohs(port));
+    peer = net_peer_get_by_addr(&addr);
+
+    /* hack: if someone from the destination ip is registered as p2p client, ignore destination port */
+    if (peer == NET_PEER_NONE && ntohs(port) == 8054)
+    {
+        for (peer = net_peer_get_by_ip(ip); peer != NET_PEER_NONE; peer = net_peer_next_by_ip(peer))
+        {
+            if (client_get(peer)->p2p)
+            {
+                break;
+            }
+        }
+    }
+
+    return peer;
+}
+
+static Client *client_find_to(uint32_t ip, uint16_t port)
+{
+    int peer = relay_find(ip, port);
+    return peer == NET_PEER_NONE ? NULL : client_get(peer);
+}
+
+static void group_add(Client *client)
+{
+    Group *group = &groups[client->game];
+
+    if (group->count == group->size)
+    {
+        group->size = group->size ? group->size * 2 : 64;
+        group->members = realloc(group->members, group->size * sizeof(int32_t));
+    }
+
+    client->group_pos = group->count;
+    group->members[group->count++] = client->peer;
+    query_version++;
+}
+
+static void group_del(Client *client)
+{
+    Group *group = &groups[client->game];
+    int32_t last = group->members[--group->count];
+
+    query_version++;
+
+    /* swap the last member into our place */
+    if (last != client->peer)
+    {
+        group->members[client->group_pos] = last;
+        client_get(last)->group_pos = client->group_pos;
+    }
+}
+
+static void client_set_game(Client *client, uint8_t game)
+{
+    if (client->game != game)
+    {
+        group_del(client);
+        client->game = game;
+        group_add(client);
+    }
+}
+
+static Miss *miss_slot(uint32_t ip, uint16_t port)
+{
+    uint64_t key = ((uint64_t)ip << 16) | port;
+    return &misses[(uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 52)];
+}
+
+static int miss_get(uint32_t ip, uint16_t port, uint64_t now)
+{
+    Miss *m = miss_slot(ip, port);
+    return m->expires > now && m->key == (((uint64_t)ip << 16) | port);
+}
+
+static void miss_put(uint32_t ip, uint16_t port, uint64_t now)
+{
+    Miss *m = miss_slot(ip, port);
+    m->key = ((uint64_t)ip << 16) | port;
+    m->expires = now + MISS_TTL;
+}
+
+static void miss_del(uint32_t ip, uint16_t port)
+{
+    Miss *m = miss_slot(ip, port);
+
+    if (m->key == (((uint64_t)ip << 16) | port))
+    {
+        m->expires = 0;
+    }
+}
+
+/* the client just became reachable by its address and, when p2p, by the fake port */
+static void miss_reachable(struct sockaddr_in *addr)
+{
+    miss_del(addr->sin_addr.s_addr, addr->sin_port);
+    miss_del(addr->sin_addr.s_addr, htons(8054));
+}
+
+static struct sockaddr_in *client_addr(Client *client)
+{
+    return net_peer_get(client->peer);
+}
+
+/* tell the other nodes where the client is and what it plays */
+static void client_announce(Client *client, int left)
+{
+    if (relay_cl.update)
+    {
+        side_lock();
+        relay_cl.update(client_addr(client), left ? -1 : client->game, client->p2p);
+        side_unlock();
+    }
+}
+
+static Client *client_new(struct sockaddr_in *addr)
+{
+    Client *client;
+    int peer = net_peer_add(addr);
+
+    if (peer == NET_PEER_NONE)
+    {
+        return NULL;
+    }
+
+    client = client_get(peer);
+    client->peer = peer;
+    client->game = GAME_UNKNOWN;
+    group_add(client);
+    miss_reachable(addr);
+    client_announce(client, 0);
+    return client;
+}
+
+static void client_remove(Client *client)
+{
+    client_announce(client, 1);
+    group_del(client);
+    timer_del(&timers, &client->timer);
+    net_peer_remove(client->peer);
+}
+
+static void stats_out(int outcome, size_t len)
+{
+    stats_local()->packets_out++;
+    stats_local()->bytes_out += len;
+
+    if (outcome < OUTCOME_LAST)
+    {
+        stats_local()->outcome[outcome]++;
+    }
+}
+
+/* send what was written to the output buffer, it is discarded afterwards */
+static void relay_send_written(struct sockaddr_in *dst)
+{
+    size_t len;
+    void *buf = net_send_buf(&len);
+
+    relay_io.send(buf, len, dst);
+    stats_out(OUTCOME_LAST, len);
+    net_send_discard();
+}
+
+/* pings carry the low bits of the send time, the echo of the last one gives a round trip sample */
+static void client_ping(Client *client, uint64_t now)
+{
+    if (client->ping_pending)
+    {
+        client->pings_lost++;
+        stats_local()->pings_lost++;
+    }
+
+    client->ping_token = (uint32_t)now;
+    client->ping_pending = 1;
+    client->pings_sent++;
+    client->last_ping = now;
+    stats_local()->pings_sent++;
+
+    net_write_int8(CMD_PING);
+    net_write_int32(client->ping_token);
+    relay_send_written(client_addr(client));
+}
+
+static void client_pong(Client *client, uint32_t token, uint64_t now)
+{
+    uint32_t rtt;
+    int32_t err;
+    int i;
+
+    /* an old ping, something made up or a reply to a ping count from before the stamps */
+    if (!client->ping_pending || token != client->ping_token)
+    {
+        return;
+    }
+
+    client->ping_pending = 0;
+    rtt = (now - client->last_ping) * 1000;
+
+    if (client->srtt_us == 0)
+    {
+        client->srtt_us = rtt > 0 ? rtt : 1;
+        client->rttvar_us = rtt / 2;
+    }
+    else
+    {
+        err = (int32_t)(rtt - client->srtt_us);
+        client->srtt_us += err / 8;
+        client->rttvar_us += ((err < 0 ? -err : err) - (int32_t)client->rttvar_us) / 4;
+    }
+
+    i = 0;
+    while (i < RTT_BUCKETS && rtt > rtt_bounds[i] * 1000)
+    {
+        i++;
+    }
+
+    stats_local()->rtt[i]++;
+    stats_local()->rtt_sum_us += rtt;
+    stats_local()->rtt_samples++;
+}
+
+/* for log lines when a client leaves */
+static const char *client_rtt_str(Client *client)
+{
+    static char buf[96];
+
+    if (client->srtt_us == 0)
+    {
+        return "no rtt";
+    }
+
+    snprintf(buf, sizeof(buf), "rtt %u ms, jitter %u ms, loss %u%%",
+        client->srtt_us / 1000, client->rttvar_us / 1000,
+        client->pings_sent ? client->pings_lost * 100 / client->pings_sent : 0);
+    return buf;
+}
+
+/* queue a packet to every member of a group except the sender */
+static void group_send(Group *group, Client *from, uint8_t *pkt, size_t len)
+{
+    int skip = from ? from->peer : NET_PEER_NONE;
+    int i;
+
+    for (i = 0; i < group->count; i++)
+    {
+        if (group->members[i] != skip)
+        {
+            relay_io.send(pkt, len, net_peer_get(group->members[i]));
+            stats_out(OUTCOME_FORWARDED, len);
+        }
+    }
+}
+
+/* query responds with the basic server information to display on a server browser, the reply is
+ * cached per thread and only rebuilt when a count changes or once a second for the uptime */
+static void relay_query(struct sockaddr_in *peer, uint64_t now)
+{
+    uint32_t uptime = (now - booted) / 1000;
+
+    if (query_len == 0 || query_built_version != query_version || query_built_uptime != uptime)
+    {
+        void *buf;
+
+        /* replies still in the transmit queue point at the old one */
+        relay_io.flush();
+
+        net_write_int8(CMD_QUERY);
+        net_write_string("hostname");
+        net_write_string(relay_hostname);
+        net_write_string("clients");
+        net_write_string_int32(net_peer_count());
+        net_write_string("maxclients");
+        net_write_string_int32(relay_maxclients);
+        net_write_string("version");
+        net_write_string(VERSION);
+        net_write_string("uptime");
+        net_write_string_int32(uptime);
+        net_write_string("unk");
+        net_write_string_int32(groups[GAME_UNKNOWN].count);
+        net_write_string("cnc95");
+        net_write_string_int32(groups[GAME_CNC95].count);
+        net_write_string("ra95");
+        net_write_string_int32(groups[GAME_RA95].count);
+        net_write_string("ts");
+        net_write_string_int32(groups[GAME_TS].count);
+        net_write_string("tsdta");
+        net_write_string_int32(groups[GAME_TSDTA].count);
+        net_write_string("tsti");
+        net_write_string_int32(groups[GAME_TSTI].count);
+        net_write_string("ra2");
+        net_write_string_int32(groups[GAME_RA2].count);
+
+        buf = net_send_buf(&query_len);
+        memcpy(query_buf, buf, query_len);
+        net_send_discard();
+
+        query_built_version = query_version;
+        query_built_uptime = uptime;
+    }
+
+    relay_io.send(query_buf, query_len, peer);
+    stats_out(OUTCOME_LAST, query_len);
+}
+
+/* incoming (cmd, to_ip, to_port) and outgoing (cmd, from_ip, from_port) headers are the same size,
+ * so relayed packets are rewritten in place and sent straight from the receive buffer */
+static void relay_header(uint8_t *pkt, uint32_t ip, uint16_t port)
+{
+    memcpy(pkt + 1, &ip, 4);
+    memcpy(pkt + 5, &port, 2);
+}
+
+/* hand a direct packet to the node of the cluster where the destination is, the header is
+ * put back on a miss as the packet may be parsed again */
+static int relay_route(uint8_t *pkt, size_t len, struct sockaddr_in *peer, uint32_t ip, uint16_t port)
+{
+    int ret;
+
+    if (relay_cl.route == NULL)
+    {
+        return 0;
+    }
+
+    relay_header(pkt, peer->sin_addr.s_addr, peer->sin_port);
+
+    side_lock();
+    ret = relay_cl.route(pkt, len, ip, port);
+    side_unlock();
+
+    if (!ret)
+    {
+        relay_header(pkt, ip, port);
+    }
+
+    return ret;
+}
+
+/* try to detect any supported game from the payload of a broadcast */
+static uint8_t classify(uint64_t sig, size_t len)
+{
+    int i;
+
+    for (i = 0; i < num_matchers; i++)
+    {
+        if ((sig & matchers[i].mask) == matchers[i].value && len >= matchers[i].need)
+        {
+            return matchers[i].game;
+        }
+    }
+
+    return GAME_UNKNOWN;
+}
+
+static uint64_t signature_of(const uint8_t *buf, size_t len)
+{
+    uint64_t sig = 0;
+    memcpy(&sig, buf, len < SIGNATURE_WINDOW ? len : SIGNATURE_WINDOW);
+    return sig;
+}
+
+uint8_t relay_classify(const uint8_t *buf, size_t len)
+{
+    return classify(signature_of(buf, len), len);
+}
+
+/* budget class of the current datagram, the destination is peeked from the header without reading it */
+static int relay_shed(struct sockaddr_in *peer, uint8_t cmd, uint64_t now)
+{
+    uint8_t *pkt;
+    size_t pkt_len;
+    int class, ret;
+
+    switch (cmd)
+    {
+        case CMD_QUERY:
+        case CMD_TESTP2P:
+            class = RATE_QUERY;
+            break;
+        case CMD_DISCONNECT:
+            return 0;
+        case CMD_TUNNEL:
+        case CMD_P2P:
+            pkt = net_recv_buf(&pkt_len);
+            if (pkt_len >= 5 && pkt[1] == 0xFF && pkt[2] == 0xFF && pkt[3] == 0xFF && pkt[4] == 0xFF)
+            {
+                class = RATE_BROADCAST;
+                break;
+            }
+            /* fall through */
+        default:
+            class = RATE_DIRECT;
+            break;
+    }
+
+    side_lock();
+    ret = rate_check(&limits, ntohl(peer->sin_addr.s_addr), class, now);
+    side_unlock();
+
+    if (ret == RATE_PASS)
+    {
+        return 0;
+    }
+
+    stats_local()->shed[class]++;
+
+    if (ret == RATE_SHED_SUBNET)
+    {
+        stats_local()->shed_subnet++;
+    }
+
+    return 1;
+}
+
+/* everything from looking up the sender on. Shared, only the registry is read and the sender's own client
+ * is written, which is fine as all packets from an address arrive at the same worker; whatever would
+ * change more returns RELAY_EXCLUSIVE before it changed anything */
+static int relay_client_packet(struct sockaddr_in *peer, uint8_t cmd, uint64_t now, int shared)
+{
+    Client *client;
+    uint8_t *buf, *pkt;
+    size_t pkt_len, len;
+
+    /* look for our client */
+    client = client_find(peer);
+
+    if (client == NULL)
+    {
+        /* ignore disconnect packets swhen not connected */
+        if (cmd == CMD_DISCONNECT)
+        {
+            return RELAY_DONE;
+        }
+
+        if (shared)
+        {
+            return RELAY_EXCLUSIVE;
+        }
+
+        /* ignore new clients when hitting the maximum, can't do much more than that */
+        client = client_new(peer);
+        if (client == NULL)
+        {
+            stats_local()->outcome[OUTCOME_MAXCLIENTS]++;
+            return RELAY_DONE;
+        }
+
+        /* the deadline is only checked when it fires, activity in between just moves last_packet */
+        timer_add(&timers, &client->timer, now + relay_timeout * 1000);
+    }
+
+    /* the first packet of a client is logged and may well change its game */
+    if (shared && (cmd == CMD_DISCONNECT || client->last_packet == 0))
+    {
+        return RELAY_EXCLUSIVE;
+    }
+
+    if (cmd == CMD_DISCONNECT)
+    {
+        log_printf("%s:%d disconnected (%s)\n", inet_ntoa(peer->sin_addr), ntohs(peer->sin_port), client_rtt_str(client));
+        client_remove(client);
+        /* special packet from clients who are closing the socket so we can remove them from the active list before timeout */
+        return RELAY_DONE;
+    }
+
+    if (cmd == CMD_PING)
+    {
+        client_pong(client, net_read_int32(), now);
+        client->last_packet = now;
+        client->ping_count = 0;
+        return RELAY_DONE;
+    }
+
+    uint32_t to_ip = net_read_int32();
+    uint16_t to_port = net_read_int16();
+    Client *client_to = NULL;
+    pkt = net_recv_buf(&pkt_len);
+    buf = net_read_ptr(&len);
+
+    /* discard invalid destinations */
+    if (to_ip == 0 || to_port == 0) {
+        if (shared && client->game == GAME_UNKNOWN)
+        {
+            return RELAY_EXCLUSIVE;
+        }
+
+        stats_local()->outcome[OUTCOME_STRAY]++;
+
+        /* if it was a complete stray packet, just ignore the client completely */
+        if (client->game == GAME_UNKNOWN)
+        {
+            client_remove(client);
+        }
+        return RELAY_DONE;
+    }
+
+    /* broadcast */
+    if (to_ip == 0xFFFFFFFF)
+    {
+        uint64_t sig = signature_of(buf, len);
+        uint8_t sig_len = (len < SIGNATURE_WINDOW ? len : SIGNATURE_WINDOW) + 1;
+        uint8_t game = client->game;
+
+        if (sig != client->sig || sig_len != client->sig_len)
+        {
+            game = classify(sig, len);
+        }
+
+        /* groups are changed and the other nodes told */
+        if (shared && (game != client->game || client->p2p != (cmd == CMD_P2P)))
+        {
+            return RELAY_EXCLUSIVE;
+        }
+
+        client->sig = sig;
+        client->sig_len = sig_len;
+
+        if (cmd == CMD_P2P && !client->p2p)
+        {
+            miss_reachable(peer);
+        }
+
+        if (game != client->game || client->p2p != (cmd == CMD_P2P))
+        {
+            client_set_game(client, game);
+            client->p2p = (cmd == CMD_P2P);
+            client_announce(client, 0);
+        }
+
+        if (client->last_packet == 0)
+        {
+            log_printf("%s:%d connected with %s (%s)\n", inet_ntoa(peer->sin_addr), ntohs(peer->sin_port), game_str(client->game), cmd == CMD_P2P ? "p2p" : "tun");
+        }
+
+        /* hack: the motd bot can connect with an empty broadcast without broadcasting anything */
+        if (len)
+        {
+            stats_local()->game[client->game]++;
+
+            /* fake P2P port, always */
+            relay_header(pkt, peer->sin_addr.s_addr, cmd == CMD_P2P ? htons(8054) : peer->sin_port);
+
+            group_send(&groups[client->game], client, pkt, pkt_len);
+
+            /* hack: sending all broadcasts to unknown clients so the welcome bot gets connects, can also be used to monitor cncnet */
+            if (client->game != GAME_UNKNOWN)
+            {
+                group_send(&groups[GAME_UNKNOWN], client, pkt, pkt_len);
+            }
+
+            if (relay_cl.broadcast)
+            {
+                side_lock();
+                relay_cl.broadcast(pkt, pkt_len, client->game);
+                side_unlock();
+            }
+        }
+    }
+    else
+    /* direct */
+    {
+        if (client->last_packet == 0)
+        {
+            log_printf("%s:%d connected with direct packet, possibly a desync\n", inet_ntoa(peer->sin_addr), ntohs(peer->sin_port));
+        }
+
+        if (miss_get(to_ip, to_port, now))
+        {
+            stats_local()->outcome[OUTCOME_MISROUTED]++;
+        }
+        else if ((client_to = client_find_to(to_ip, to_port)) != NULL)
+        {
+            relay_header(pkt, peer->sin_addr.s_addr, peer->sin_port);
+            relay_io.send(pkt, pkt_len, client_addr(client_to));
+            stats_local()->game[client->game]++;
+            stats_out(OUTCOME_FORWARDED, pkt_len);
+        }
+        else if (relay_route(pkt, pkt_len, peer, to_ip, to_port))
+        {
+            stats_local()->game[client->game]++;
+            stats_local()->outcome[OUTCOME_CLUSTER]++;
+        }
+        else if (shared)
+        {
+            /* remembered as a miss */
+            return RELAY_EXCLUSIVE;
+        }
+        else
+        {
+            char from[16];
+
+            /* inet_ntoa shares one buffer */
+            strncpy(from, inet_ntoa(peer->sin_addr), sizeof(from) - 1);
+            from[sizeof(from) - 1] = '\0';
+
+            stats_local()->outcome[OUTCOME_UNKNOWN_DEST]++;
+            miss_put(to_ip, to_port, now);
+            log_printf("%s:%d tried to send to unknown client %s:%d\n", from, ntohs(peer->sin_port), inet_ntoa(*(struct in_addr *)&to_ip), ntohs(to_port));
+        }
+    }
+
+    client->last_packet = now;
+    client->ping_count = 0;
+    return RELAY_DONE;
+}
+
+int relay_packet_shared(struct sockaddr_in *peer, size_t len, uint64_t now)
+{
+    RelayStats *stats = stats_local();
+    uint8_t cmd;
+
+    net_send_discard();
+
+    stats->packets_in++;
+    stats->bytes_in += len;
+
+    if (len == 0)
+    {
+        return RELAY_DONE;
+    }
+
+    cmd = net_read_int8();
+    stats->cmd[cmd < CMD_LAST ? cmd : CMD_LAST]++;
+
+    /* flood protection, before anything is looked up, answered or fanned out */
+    if (limits.sources && relay_shed(peer, cmd, now))
+    {
+        return RELAY_DONE;
+    }
+
+    if (cmd == CMD_QUERY)
+    {
+        relay_query(peer, now);
+        return RELAY_DONE;
+    }
+
+    if (cmd == CMD_TESTP2P)
+    {
+        net_write_int8(CMD_TESTP2P);
+        net_write_int32(net_read_int32());
+        peer->sin_port = htons(8054);
+
+        relay_send_written(peer);
+        return RELAY_DONE;
+    }
+
+    return relay_client_packet(peer, cmd, now, 1);
+}
+
+void relay_packet_exclusive(struct sockaddr_in *peer, uint64_t now)
+{
+    size_t len;
+    void *pkt = net_recv_buf(&len);
+
+    /* from the top, the shared attempt read some of it already */
+    net_recv_set(pkt, len);
+    relay_client_packet(peer, net_read_int8(), now, 0);
+}
+
+void relay_packet(struct sockaddr_in *peer, size_t len, uint64_t now)
+{
+    if (relay_packet_shared(peer, len, now) == RELAY_EXCLUSIVE)
+    {
+        relay_packet_exclusive(peer, now);
+    }
+}
+
+void relay_timeouts(uint64_t now)
+{
+    Timer *timer;
+    Client *client;
+
+    while ((timer = timer_expire(&timers, now)))
+    {
+        client = (Client *)((char *)timer - offsetof(Client, timer));
+
+        /* heard from in the meantime, sleep until the real deadline */
+        if (now - client->last_packet < relay_timeout * 1000)
+        {
+            /* the only chance to measure players in a game, they are never silent long enough to get pinged */
+            if (relay_probing && now - client->last_ping >= PING_INTERVAL)
+            {
+                client_ping(client, now);
+                stats_local()->probes++;
+            }
+
+            timer_add(&timers, &client->timer, client->last_packet + relay_timeout * 1000);
+            continue;
+        }
+
+        if (client->ping_count > 2)
+        {
+            log_printf("%s:%d timed out (%s)\n", inet_ntoa(client_addr(client)->sin_addr), ntohs(client_addr(client)->sin_port), client_rtt_str(client));
+            client_remove(client);
+            continue;
+        }
+
+        client_ping(client, now);
+        client->ping_count++;
+
+        timer_add(&timers, &client->timer, now + PING_INTERVAL);
+    }
+}
+
+/* packets relayed here by another node of the cluster, the header is already rewritten */
+void relay_deliver(const void *buf, size_t len, uint32_t ip, uint16_t port)
+{
+    struct sockaddr_in addr;
+    int peer;
+
+    net_address_ex(&addr, ip, ntohs(port));
+    peer = net_peer_get_by_addr(&addr);
+
+    if (peer == NET_PEER_NONE)
+    {
+        stats_local()->outcome[OUTCOME_UNKNOWN_DEST]++;
+        return;
+    }
+
+    relay_io.send(buf, len, net_peer_get(peer));
+    stats_out(OUTCOME_FORWARDED, len);
+}
+
+void relay_fanout(const void *buf, size_t len, int game)
+{
+    if (game < 0 || game >= GAME_LAST)
+    {
+        return;
+    }
+
+    group_send(&groups[game], NULL, (uint8_t *)buf, len);
+
+    if (game != GAME_UNKNOWN)
+    {
+        group_send(&groups[GAME_UNKNOWN], NULL, (uint8_t *)buf, len);
+    }
+}
+
+/* a client on another node, whatever was missed for it may now be delivered */
+void relay_reachable(struct sockaddr_in *addr)
+{
+    miss_reachable(addr);
+}
+
+void relay_each(void (*cb)(struct sockaddr_in *addr, int game, int p2p))
+{
+    int peer;
+
+    for (peer = net_peer_next(NET_PEER_NONE); peer != NET_PEER_NONE; peer = net_peer_next(peer))
+    {
+        Client *client = client_get(peer);
+        cb(net_peer_get(peer), client->game, client->p2p);
+    }
+}
+
+int relay_snapshot(RelaySnapshot *out, int max, uint64_t now)
+{
+    int peer, count = 0;
+
+    for (peer = net_peer_next(NET_PEER_NONE); peer != NET_PEER_NONE && count < max; peer = net_peer_next(peer))
+    {
+        Client *client = client_get(peer);
+        struct sockaddr_in *addr = net_peer_get(peer);
+
+        out[count].ip = addr->sin_addr.s_addr;
+        out[count].port = addr->sin_port;
+        out[count].p2p = client->p2p;
+        out[count].game = client->game;
+        out[count].idle = now > client->last_packet ? now - client->last_packet : 0;
+        count++;
+    }
+
+    return count;
+}
+
+/* restored clients carry on where they were, the next packet is not a connect and a silent one is pinged as usual */
+int relay_restore(const RelaySnapshot *in, int count, uint64_t now)
+{
+    struct sockaddr_in addr;
+    Client *client;
+    int i, restored = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (in[i].idle >= (uint32_t)relay_timeout * 1000 || in[i].game >= GAME_LAST)
+        {
+            continue;
+        }
+
+        net_address_ex(&addr, in[i].ip, 0);
+        addr.sin_port = in[i].port;
+
+        if (net_peer_get_by_addr(&addr) != NET_PEER_NONE || (client = client_new(&addr)) == NULL)
+        {
+            continue;
+        }
+
+        client_set_game(client, in[i].game);
+        client->p2p = in[i].p2p ? 1 : 0;
+        client->last_packet = in[i].idle < now ? now - in[i].idle : 1;
+        timer_add(&timers, &client->timer, client->last_packet + relay_timeout * 1000);
+        client_announce(client, 0);
+        restored++;
+    }
+
+    return restored;
+}
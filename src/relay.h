@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2011, 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* the packet handling core, it reads the current datagram from net.c and only emits through RelayIO,
+ * include net.h and rate.h first */
+
+enum
+{
+    GAME_UNKNOWN,
+    GAME_CNC95,
+    GAME_RA95,
+    GAME_TS,
+    GAME_TSDTA,
+    GAME_TSTI,
+    GAME_RA2,
+    GAME_LAST
+};
+
+enum
+{
+    CMD_TUNNEL,     /* 0 */
+    CMD_P2P,        /* 1 */
+    CMD_DISCONNECT, /* 2 */
+    CMD_PING,       /* 3 */
+    CMD_QUERY,      /* 4 */
+    CMD_TESTP2P,    /* 5 */
+    CMD_LAST
+};
+
+enum
+{
+    OUTCOME_FORWARDED,
+    OUTCOME_UNKNOWN_DEST,
+    OUTCOME_STRAY,
+    OUTCOME_MAXCLIENTS,
+    OUTCOME_MISROUTED,      /* repeats of a recent unknown destination, dropped without a lookup */
+    OUTCOME_CLUSTER,        /* direct packets handed to the node of the destination */
+    OUTCOME_LAST
+};
+
+const char *game_str(int game);
+const char *cmd_str(int cmd);
+const char *outcome_str(int outcome);
+
+/* leading bytes of a broadcast that tell the game, the first SIGNATURE_WINDOW bytes are all that is looked at */
+#define SIGNATURE_WINDOW    8
+#define SIGNATURE_MAX       64
+
+typedef struct Signature
+{
+    uint8_t             game;
+    uint8_t             offset;
+    uint8_t             len;
+    uint8_t             bytes[SIGNATURE_WINDOW];
+} Signature;
+
+/* time between pings to a silent client, all times are monotonic milliseconds */
+#define PING_INTERVAL 5000
+
+/* upper bounds of the round trip histogram in milliseconds, one more bucket catches the rest */
+#define RTT_BUCKETS 9
+extern const uint32_t rtt_bounds[RTT_BUCKETS];
+
+typedef struct RelayStats
+{
+    uint64_t            packets_in;
+    uint64_t            bytes_in;
+    uint64_t            packets_out;
+    uint64_t            bytes_out;
+    uint64_t            cmd[CMD_LAST + 1];      /* the last one counts invalid commands */
+    uint64_t            game[GAME_LAST];        /* relayed packets by the game of the sender */
+    uint64_t            outcome[OUTCOME_LAST];
+    uint64_t            shed[RATE_LAST];        /* dropped by the rate limits before any other work */
+    uint64_t            shed_subnet;            /* of those, dropped by the /24 budget */
+    uint64_t            pings_sent;
+    uint64_t            pings_lost;             /* a newer ping was sent before the echo came */
+    uint64_t            probes;                 /* pings to active clients only to measure them */
+    uint64_t            rtt[RTT_BUCKETS + 1];   /* without probes only of clients that went silent */
+    uint64_t            rtt_sum_us;
+    uint64_t            rtt_samples;
+} RelayStats;
+
+/* buffers passed to send stay valid until flush or the next received datagram */
+typedef struct RelayIO
+{
+    void                (*send)(const void *buf, size_t len, struct sockaddr_in *dst);
+    void                (*flush)();
+} RelayIO;
+
+/* set when this relay is a node of a cluster, called with the relay state held, shared or not, and never
+ * by two threads at once */
+typedef struct RelayCluster
+{
+    void                (*update)(struct sockaddr_in *addr, int game, int p2p);    /* game is -1 when it left */
+    int                 (*route)(const void *buf, size_t len, uint32_t ip, uint16_t port);
+    void                (*broadcast)(const void *buf, size_t len, int game);
+} RelayCluster;
+
+/* the sum over all threads as of the last relay_stats_collect */
+extern RelayStats relay_stats;
+
+/* io may be NULL for the net.c transmit queue, times are monotonic milliseconds */
+void relay_init(const char *hostname, int timeout, int maxclients, RelayIO *io, uint64_t now);
+void relay_free();
+/* packets per second per source for each RATE_ class, all zero turns limiting off */
+int relay_limit(const int32_t *rate);
+void relay_cluster(RelayCluster *cluster);
+/* also ping clients that are not silent to measure them, off by default as game clients never got those,
+ * so the rtt stats only cover clients that went silent for a ping interval unless it is on */
+void relay_probe(int enabled);
+/* checked before the built in ones in the order added, -1 when it doesn't fit the window or the table is full */
+int relay_signature(const Signature *sig);
+
+uint8_t relay_classify(const uint8_t *buf, size_t len);
+int relay_find(uint32_t ip, uint16_t port);
+void relay_stats_collect();
+
+/* relay_packet in two steps for threads that share the relay. The first needs the state only for
+ * reading and handles most packets, when it returns RELAY_EXCLUSIVE the packet still has to go through
+ * the second with the state held exclusively. So do relay_timeouts, relay_restore and what the
+ * cluster calls, counts and lookups only read it */
+#define RELAY_DONE          0
+#define RELAY_EXCLUSIVE     1
+
+int relay_packet_shared(struct sockaddr_in *peer, size_t len, uint64_t now);
+void relay_packet_exclusive(struct sockaddr_in *peer, uint64_t now);
+void relay_packet(struct sockaddr_in *peer, size_t len, uint64_t now);
+void relay_timeouts(uint64_t now);
+int relay_clients(int game);
+
+/* the other direction of a cluster, packets and clients of other nodes. Packets are queued as they are,
+ * buf has to stay put until the transmit queue is flushed */
+void relay_deliver(const void *buf, size_t len, uint32_t ip, uint16_t port);
+void relay_fanout(const void *buf, size_t len, int game);
+void relay_reachable(struct sockaddr_in *addr);
+void relay_each(void (*cb)(struct sockaddr_in *addr, int game, int p2p));
+
+/* what a client table is carried over in, to a new process or across a restart */
+typedef struct RelaySnapshot
+{
+    uint32_t            ip;         /* network byte order */
+    uint16_t            port;       /* network byte order */
+    uint8_t             p2p;
+    uint8_t             game;
+    uint32_t            idle;       /* milliseconds since the last packet */
+} RelaySnapshot;
+
+/* returns the number of clients written, restore skips those idle past the timeout */
+int relay_snapshot(RelaySnapshot *out, int max, uint64_t now);
+int relay_restore(const RelaySnapshot *in, int count, uint64_t now);
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Replays a capture taken with cncnet-dedicated -d against a server on
+ * loopback. Every source address in the capture gets its own socket on a
+ * distinct 127.0.0.0/8 address, keeping the original port when possible, so
+ * the server sees the same set of clients and the p2p rules still apply.
+ * Direct packet destinations are rewritten to the replayed addresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "net.h"
+#include "hash.h"
+#include "timer.h"
+
+#define REPLAY_EVENTS 256
+
+typedef struct Source
+{
+    int                 fd;
+    struct sockaddr_in  local;
+} Source;
+
+typedef struct Record
+{
+    NetCaptureRecord    hdr;
+    uint8_t             *data;
+    Source              *src;
+    uint64_t            sent;
+} Record;
+
+static Hash ip_map;
+static Hash sources;
+static Hash in_flight;
+static uint32_t num_ips;
+static uint32_t num_sources;
+static int epfd;
+
+static uint64_t forwarded;
+static uint64_t replies;
+static uint32_t *samples;
+static size_t num_samples;
+static size_t max_samples;
+
+static uint32_t map_ip(uint32_t ip)
+{
+    uint32_t mapped = (uint32_t)(uintptr_t)hash_get(&ip_map, ip);
+
+    /* 127.1.0.1 and up, skipping .0 and .255 */
+    if (mapped == 0)
+    {
+        uint32_t n = num_ips++;
+        mapped = htonl(0x7F010000 + ((n / 254) << 8) + (n % 254) + 1);
+        hash_put(&ip_map, ip, (void *)(uintptr_t)mapped);
+    }
+
+    return mapped;
+}
+
+static uint64_t source_key(uint32_t ip, uint16_t port)
+{
+    return ((uint64_t)ip << 16) | port;
+}
+
+static Source *get_source(uint32_t ip, uint16_t port)
+{
+    Source *src = hash_get(&sources, source_key(ip, port));
+    socklen_t l = sizeof(struct sockaddr_in);
+    struct epoll_event ev;
+    int size = 1024 * 1024;
+
+    if (src)
+    {
+        return src;
+    }
+
+    src = calloc(1, sizeof(Source));
+    src->fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (src->fd < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+
+    setsockopt(src->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    net_address_ex(&src->local, map_ip(ip), ntohs(port));
+
+    if (bind(src->fd, (struct sockaddr *)&src->local, sizeof(src->local)) < 0)
+    {
+        net_address_ex(&src->local, map_ip(ip), 0);
+
+        if (bind(src->fd, (struct sockaddr *)&src->local, sizeof(src->local)) < 0)
+        {
+            perror("bind");
+            exit(1);
+        }
+    }
+
+    getsockname(src->fd, (struct sockaddr *)&src->local, &l);
+    fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL) | O_NONBLOCK);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev);
+
+    hash_put(&sources, source_key(ip, port), src);
+    num_sources++;
+    return src;
+}
+
+/* relayed payloads are identified by their contents and the address they were relayed from */
+static uint64_t fingerprint(const uint8_t *buf, size_t len, uint32_t from_ip)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h ^ from_ip;
+}
+
+static int is_tunnel(const uint8_t *buf, size_t len)
+{
+    return len > 7 && (buf[0] == 0 || buf[0] == 1);
+}
+
+static void drain(int timeout)
+{
+    struct epoll_event events[REPLAY_EVENTS];
+    uint8_t buf[NET_BUF_SIZE];
+    int i, n;
+
+    n = epoll_wait(epfd, events, REPLAY_EVENTS, timeout);
+
+    for (i = 0; i < n; i++)
+    {
+        Source *src = events[i].data.ptr;
+        ssize_t len;
+
+        while ((len = recv(src->fd, buf, sizeof(buf), 0)) > -1)
+        {
+            if (is_tunnel(buf, len))
+            {
+                uint32_t from_ip;
+                Record *rec;
+
+                memcpy(&from_ip, buf + 1, 4);
+                rec = hash_get(&in_flight, fingerprint(buf + 7, len - 7, from_ip));
+                forwarded++;
+
+                if (rec)
+                {
+                    if (num_samples == max_samples)
+                    {
+                        max_samples = max_samples ? max_samples * 2 : 4096;
+                        samples = realloc(samples, max_samples * sizeof(uint32_t));
+                    }
+
+                    samples[num_samples++] = timer_now_us() - rec->sent;
+                }
+            }
+            else
+            {
+                replies++;
+            }
+        }
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p)
+{
+    size_t i = (size_t)(p * (num_samples - 1));
+    return num_samples ? samples[i] : 0;
+}
+
+static Record *load(const char *path, size_t *count)
+{
+    FILE *fh = fopen(path, "rb");
+    char magic[8];
+    Record *recs = NULL;
+    size_t size = 0;
+
+    *count = 0;
+
+    if (fh == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    if (fread(magic, 1, 8, fh) != 8 || memcmp(magic, NET_CAPTURE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(fh);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        Record *rec;
+
+        if (*count == size)
+        {
+            size = size ? size * 2 : 4096;
+            recs = realloc(recs, size * sizeof(Record));
+        }
+
+        rec = &recs[*count];
+
+        if (fread(&rec->hdr, sizeof(NetCaptureRecord), 1, fh) != 1)
+        {
+            break;
+        }
+
+        rec->data = malloc(rec->hdr.len ? rec->hdr.len : 1);
+
+        if (fread(rec->data, 1, rec->hdr.len, fh) != rec->hdr.len)
+        {
+            fprintf(stderr, "%s: truncated record %u\n", path, (unsigned int)*count);
+            free(rec->data);
+            break;
+        }
+
+        (*count)++;
+    }
+
+    fclose(fh);
+    return recs;
+}
+
+int main(int argc, char **argv)
+{
+    char server_ip[32] = "127.0.0.1";
+    int server_port = 9001;
+    double speed = 1.0;
+    int fast = 0;
+    int opt;
+    size_t count, i;
+    Record *recs;
+    struct sockaddr_in server;
+    struct rlimit rl;
+    uint64_t start, elapsed, sent = 0;
+
+    while ((opt = getopt(argc, argv, "?hs:p:x:f")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                strncpy(server_ip, optarg, sizeof(server_ip)-1);
+                break;
+            case 'p':
+                server_port = atoi(optarg);
+                break;
+            case 'x':
+                speed = atof(optarg);
+                if (speed <= 0)
+                {
+                    speed = 1.0;
+                }
+                break;
+            case 'f':
+                fast = 1;
+                break;
+            case 'h':
+            case '?':
+            default:
+                fprintf(stderr, "Usage: %s [-h?] [-s server ip] [-p port] [-x speed] [-f] capture\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-h?] [-s server ip] [-p port] [-x speed] [-f] capture\n", argv[0]);
+        return 1;
+    }
+
+    recs = load(argv[optind], &count);
+    if (recs == NULL || count == 0)
+    {
+        fprintf(stderr, "Nothing to replay\n");
+        return 1;
+    }
+
+    /* a socket per captured source */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    net_address(&server, server_ip, server_port);
+    hash_init(&ip_map);
+    hash_init(&sources);
+    hash_init(&in_flight);
+    epfd = epoll_create1(0);
+
+    for (i = 0; i < count; i++)
+    {
+        recs[i].src = get_source(recs[i].hdr.ip, recs[i].hdr.port);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        Record *rec = &recs[i];
+        uint32_t to_ip;
+        uint16_t to_port;
+
+        if (!is_tunnel(rec->data, rec->hdr.len))
+        {
+            continue;
+        }
+
+        memcpy(&to_ip, rec->data + 1, 4);
+        memcpy(&to_port, rec->data + 5, 2);
+
+        if (to_ip == 0 || to_ip == 0xFFFFFFFF)
+        {
+            continue;
+        }
+
+        /* point direct packets at the replayed destination, the port only moves if it could not be kept */
+        {
+            Source *dst = hash_get(&sources, source_key(to_ip, to_port));
+
+            if (dst)
+            {
+                to_port = dst->local.sin_port;
+            }
+
+            to_ip = map_ip(to_ip);
+            memcpy(rec->data + 1, &to_ip, 4);
+            memcpy(rec->data + 5, &to_port, 2);
+        }
+    }
+
+    printf("Replaying %u packets from %u sources on %u addresses to %s:%d at %s\n",
+        (unsigned int)count, num_sources, num_ips, server_ip, server_port, fast ? "max speed" : "capture rate");
+
+    start = timer_now_us();
+
+    for (i = 0; i < count; i++)
+    {
+        Record *rec = &recs[i];
+
+        if (!fast)
+        {
+            uint64_t target = start + (uint64_t)((recs[i].hdr.ts - recs[0].hdr.ts) / speed);
+            uint64_t now;
+
+            while ((now = timer_now_us()) < target)
+            {
+                drain((target - now) / 1000);
+            }
+        }
+        else if ((i & 63) == 0)
+        {
+            drain(0);
+        }
+
+        rec->sent = timer_now_us();
+
+        if (is_tunnel(rec->data, rec->hdr.len))
+        {
+            hash_put(&in_flight, fingerprint(rec->data + 7, rec->hdr.len - 7, rec->src->local.sin_addr.s_addr), rec);
+        }
+
+        if (sendto(rec->src->fd, rec->data, rec->hdr.len, 0, (struct sockaddr *)&server, sizeof(server)) > -1)
+        {
+            sent++;
+        }
+    }
+
+    elapsed = timer_now_us() - start;
+
+    /* let the tail of the relayed traffic arrive */
+    for (i = 0; i < 10; i++)
+    {
+        drain(50);
+    }
+
+    if (elapsed == 0)
+    {
+        elapsed = 1;
+    }
+
+    qsort(samples, num_samples, sizeof(uint32_t), cmp_u32);
+
+    printf("       sent: %llu packets in %.3f s, %.0f p/s\n", (unsigned long long)sent, elapsed / 1e6, sent * 1e6 / elapsed);
+    printf("  forwarded: %llu packets, %.0f p/s\n", (unsigned long long)forwarded, forwarded * 1e6 / elapsed);
+    printf("    replies: %llu packets\n", (unsigned long long)replies);
+    printf("    latency: %llu samples, p50 %u us, p99 %u us, p999 %u us, max %u us\n",
+        (unsigned long long)num_samples, percentile(0.5), percentile(0.99), percentile(0.999), percentile(1.0));
+
+    return 0;
+}
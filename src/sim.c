@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drives the relay core in-process without sockets. Datagrams are injected
+ * with their source address, whatever the relay emits is counted by a
+ * RelayIO that never leaves the process and time is a simulated clock, so
+ * a run is deterministic and timeouts take no real time.
+ *
+ * For each client count the clients connect with game broadcasts and then
+ * every packet type is pushed through on its own to get the CPU cost per
+ * packet, and a query flood checks that the rate limits shed it. The run
+ * ends by letting every client go silent and stepping the clock until the
+ * pings and timeouts have removed all of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "net.h"
+#include "timer.h"
+#include "rate.h"
+#include "relay.h"
+
+/* clock steps a millisecond every this many packets, timeouts run on every step like once per batch */
+#define SIM_PACKETS_PER_MS  1024
+#define SIM_PAYLOAD         32
+
+typedef struct SimClient
+{
+    struct sockaddr_in  addr;
+    uint8_t             game;
+    uint8_t             p2p;
+} SimClient;
+
+static const uint8_t magic[GAME_LAST][6] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x34, 0x12, 0x00, 0x00, 0x00, 0x00 },
+    { 0x35, 0x12, 0x00, 0x00, 0x00, 0x00 },
+    { 0x00, 0x00, 0x00, 0x00, 0x35, 0x12 },
+    { 0x00, 0x00, 0x00, 0x00, 0x35, 0x13 },
+    { 0x00, 0x00, 0x00, 0x00, 0x35, 0x14 },
+    { 0x00, 0x00, 0x00, 0x00, 0x36, 0x12 },
+};
+
+/* when a client was last heard of and pinged, every ping and the timeout must come on their tick */
+typedef struct SimTiming
+{
+    uint64_t            last_packet;
+    uint64_t            last_ping;
+    uint32_t            pings;
+    uint32_t            removed;
+} SimTiming;
+
+static SimClient *clients;
+static int num_clients;
+static int *by_game[GAME_LAST];
+static int game_count[GAME_LAST];
+
+static uint64_t sim_now;
+static uint64_t sim_packets;
+static uint64_t emitted;
+static uint64_t emitted_pings;
+static uint64_t logged;
+static SimTiming *timing;
+static int timing_check;
+static int sim_timeout;
+static uint64_t late;
+static uint32_t rng = 2463534242u;
+
+static SimTiming *sim_timing(struct sockaddr_in *addr)
+{
+    uint32_t i = ntohl(addr->sin_addr.s_addr) - 0x0A000001;
+    return i < (uint32_t)num_clients ? &timing[i] : NULL;
+}
+
+/* how far off the schedule something happened, the wheel may only be up to a tick late */
+static void sim_on_time(uint64_t expected)
+{
+    if (sim_now < expected || sim_now > expected + TIMER_TICK)
+    {
+        late++;
+    }
+}
+
+/* the relay logs through log.c, here it only gets counted and timeouts are checked for their time */
+int log_printf(const char *fmt, ...)
+{
+    char line[256];
+    unsigned a, b, c, d;
+    struct sockaddr_in addr;
+    SimTiming *t;
+    va_list args;
+
+    logged++;
+
+    if (!timing_check)
+    {
+        return 0;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (strstr(line, "timed out") && sscanf(line, "%u.%u.%u.%u", &a, &b, &c, &d) == 4)
+    {
+        net_address_ex(&addr, htonl((a << 24) | (b << 16) | (c << 8) | d), 0);
+
+        if ((t = sim_timing(&addr)))
+        {
+            sim_on_time(t->last_ping + PING_INTERVAL);
+            t->removed++;
+        }
+    }
+
+    return 0;
+}
+
+int log_statusf(const char *fmt, ...)
+{
+    return 0;
+}
+
+void log_status_clear()
+{
+}
+
+static void sim_send(const void *buf, size_t len, struct sockaddr_in *dst)
+{
+    SimTiming *t;
+
+    emitted++;
+
+    if (((const uint8_t *)buf)[0] == CMD_PING)
+    {
+        emitted_pings++;
+
+        if (timing_check && (t = sim_timing(dst)))
+        {
+            sim_on_time(t->pings == 0 ? t->last_packet + sim_timeout * 1000 : t->last_ping + PING_INTERVAL);
+            t->last_ping = sim_now;
+            t->pings++;
+        }
+    }
+}
+
+static void sim_flush()
+{
+}
+
+static RelayIO sim_io = { sim_send, sim_flush };
+
+/* a cluster node that has every address of 11.0.0.0/8 and nothing else */
+#define SIM_REMOTE(ip) ((ntohl(ip) >> 24) == 11)
+
+static uint64_t routed;
+static uint64_t misrouted;
+
+static void sim_cluster_update(struct sockaddr_in *addr, int game, int p2p)
+{
+}
+
+static int sim_cluster_route(const void *buf, size_t len, uint32_t ip, uint16_t port)
+{
+    if (!SIM_REMOTE(ip))
+    {
+        return 0;
+    }
+
+    routed++;
+
+    /* it has to carry the sender, not the destination */
+    if (SIM_REMOTE(*(const uint32_t *)((const uint8_t *)buf + 1)))
+    {
+        misrouted++;
+    }
+
+    return 1;
+}
+
+static void sim_cluster_broadcast(const void *buf, size_t len, int game)
+{
+}
+
+static RelayCluster sim_cluster = { sim_cluster_update, sim_cluster_route, sim_cluster_broadcast };
+
+static uint32_t sim_rand()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static void sim_inject(struct sockaddr_in *from, const uint8_t *pkt, size_t len)
+{
+    uint8_t buf[NET_BUF_SIZE];
+    struct sockaddr_in peer = *from;
+    SimTiming *t;
+
+    /* the relay rewrites headers in place, like a fresh receive buffer every time */
+    memcpy(buf, pkt, len);
+    net_recv_set(buf, len);
+
+    if ((t = sim_timing(&peer)))
+    {
+        t->last_packet = sim_now;
+    }
+
+    relay_packet(&peer, len, sim_now);
+
+    if ((++sim_packets % SIM_PACKETS_PER_MS) == 0)
+    {
+        sim_now++;
+        relay_timeouts(sim_now);
+    }
+}
+
+static size_t build_tunnel(uint8_t *pkt, SimClient *c, uint32_t to_ip, uint16_t to_port)
+{
+    pkt[0] = c->p2p ? CMD_P2P : CMD_TUNNEL;
+    memcpy(pkt + 1, &to_ip, 4);
+    memcpy(pkt + 5, &to_port, 2);
+    memset(pkt + 7, 0xAA, SIM_PAYLOAD);
+    memcpy(pkt + 7, magic[c->game], 6);
+    return 7 + SIM_PAYLOAD;
+}
+
+static SimClient *random_peer(SimClient *c)
+{
+    SimClient *to;
+
+    if (game_count[c->game] < 2)
+    {
+        return c == &clients[0] ? &clients[1] : &clients[0];
+    }
+
+    do
+    {
+        to = &clients[by_game[c->game][sim_rand() % game_count[c->game]]];
+    } while (to == c);
+
+    return to;
+}
+
+static void report(const char *phase, uint64_t packets, uint64_t out, uint64_t expected, uint64_t us)
+{
+    printf("%9d  %-10s %10llu %12llu %10.1f  %s\n", num_clients, phase,
+        (unsigned long long)packets, (unsigned long long)out, packets ? us * 1000.0 / packets : 0.0,
+        out == expected ? "ok" : "MISMATCH");
+}
+
+static void run(int n, int packets, int timeout)
+{
+    uint8_t pkt[NET_BUF_SIZE];
+    struct sockaddr_in browser;
+    uint64_t start, out, expected, probes, unknown;
+    int i, g, count;
+
+    num_clients = n;
+    clients = calloc(n, sizeof(SimClient));
+    timing = calloc(n, sizeof(SimTiming));
+    sim_timeout = timeout;
+    memset(game_count, 0, sizeof(game_count));
+
+    for (g = 0; g < GAME_LAST; g++)
+    {
+        by_game[g] = calloc(n, sizeof(int));
+    }
+
+    /* every fifth client is p2p behind a nat, so its real port is not 8054 */
+    for (i = 0; i < n; i++)
+    {
+        SimClient *c = &clients[i];
+
+        c->game = 1 + i % (GAME_LAST - 1);
+        c->p2p = (i % 5) == 0;
+        net_address_ex(&c->addr, htonl(0x0A000000 + i + 1), 1024 + (i % 60000));
+        by_game[c->game][game_count[c->game]++] = i;
+    }
+
+    net_address_ex(&browser, htonl(0xC0A80001), 5000);
+
+    sim_now = 1000000;
+    sim_packets = 0;
+    relay_init("Simulated", timeout, 0, &sim_io, sim_now);
+
+    /* connect, every broadcast reaches the players of the game that already joined */
+    emitted = 0;
+    expected = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < n; i++)
+    {
+        expected += relay_clients(clients[i].game);
+        sim_inject(&clients[i].addr, pkt, build_tunnel(pkt, &clients[i], 0xFFFFFFFF, 0xFFFF));
+    }
+
+    report("connect", n, emitted, expected, timer_now_us() - start);
+
+    /* direct packets to players of the same game, p2p players are addressed with the fake port */
+    emitted = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < packets; i++)
+    {
+        SimClient *c = &clients[sim_rand() % n];
+        SimClient *to = random_peer(c);
+
+        sim_inject(&c->addr, pkt, build_tunnel(pkt, c, to->addr.sin_addr.s_addr, to->p2p ? htons(8054) : to->addr.sin_port));
+    }
+
+    report("direct", packets, emitted, packets, timer_now_us() - start);
+
+    /* only the 8054 lookup by ip */
+    emitted = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < packets; i++)
+    {
+        SimClient *c = &clients[sim_rand() % n];
+        SimClient *to = &clients[(sim_rand() % ((n + 4) / 5)) * 5];
+
+        if (to == c)
+        {
+            to = c == &clients[0] ? &clients[n > 5 ? 5 : 0] : &clients[0];
+        }
+
+        sim_inject(&c->addr, pkt, build_tunnel(pkt, c, to->addr.sin_addr.s_addr, htons(8054)));
+    }
+
+    report("p2p", packets, emitted, n > 5 ? packets : emitted, timer_now_us() - start);
+
+    /* direct packets to another node, every other one to an address no node has which must not come back */
+    relay_cluster(&sim_cluster);
+    relay_stats_collect();
+    unknown = relay_stats.outcome[OUTCOME_UNKNOWN_DEST];
+    count = packets / 10 + 2;
+    emitted = 0;
+    routed = 0;
+    misrouted = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < count; i++)
+    {
+        SimClient *c = &clients[sim_rand() % n];
+        uint32_t to_ip = htonl(((i & 1) ? 0x0C000000 : 0x0B000000) + i);
+
+        sim_inject(&c->addr, pkt, build_tunnel(pkt, c, to_ip, htons(1024)));
+    }
+
+    relay_cluster(NULL);
+    relay_stats_collect();
+
+    printf("%9d  %-10s %10llu %12llu %10.1f  %s, %llu routed, %llu unknown\n", num_clients, "cluster",
+        (unsigned long long)count, (unsigned long long)emitted, (timer_now_us() - start) * 1000.0 / count,
+        emitted == 0 && misrouted == 0 && routed == (uint64_t)(count + 1) / 2 &&
+        relay_stats.outcome[OUTCOME_UNKNOWN_DEST] - unknown == (uint64_t)count / 2 ? "ok" : "MISMATCH",
+        (unsigned long long)routed, (unsigned long long)(relay_stats.outcome[OUTCOME_UNKNOWN_DEST] - unknown));
+
+    /* broadcasts, fewer of them as the games grow so the fan-out stays comparable */
+    count = packets / (n / (GAME_LAST - 1) + 1) + 1;
+    emitted = 0;
+    expected = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < count; i++)
+    {
+        SimClient *c = &clients[sim_rand() % n];
+
+        expected += game_count[c->game] - 1;
+        sim_inject(&c->addr, pkt, build_tunnel(pkt, c, 0xFFFFFFFF, 0xFFFF));
+    }
+
+    out = emitted;
+    printf("%9d  %-10s %10llu %12llu %10.1f  %s, %.1f ns per copy\n", num_clients, "broadcast",
+        (unsigned long long)count, (unsigned long long)out, (timer_now_us() - start) * 1000.0 / count,
+        out == expected ? "ok" : "MISMATCH", out ? (timer_now_us() - start) * 1000.0 / out : 0.0);
+
+    /* server browsers */
+    pkt[0] = CMD_QUERY;
+    emitted = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < packets; i++)
+    {
+        sim_inject(&browser, pkt, 1);
+    }
+
+    report("query", packets, emitted, packets, timer_now_us() - start);
+
+    /* two browsers sharing a rate limit slot flood queries in turns, together they get no more than
+     * their own budgets, 100 a second plus the second of burst each */
+    {
+        int32_t rate[RATE_LAST] = { 100, 0, 0 };
+        int32_t none[RATE_LAST] = { 0, 0, 0 };
+        struct sockaddr_in flood[2];
+        uint32_t ip = 0xC0A80101;
+        uint64_t began = sim_now, budget;
+
+        while (rate_slot(++ip) != rate_slot(0xC0A80101))
+        {
+        }
+
+        net_address_ex(&flood[0], htonl(0xC0A80101), 5000);
+        net_address_ex(&flood[1], htonl(ip), 5000);
+        relay_limit(rate);
+        emitted = 0;
+        start = timer_now_us();
+
+        for (i = 0; i < packets; i++)
+        {
+            sim_inject(&flood[i & 1], pkt, 1);
+        }
+
+        budget = 2 * (100 + (sim_now - began) * 100 / 1000 + 1);
+        relay_limit(none);
+
+        report("flood", packets, emitted, emitted <= budget ? emitted : budget, timer_now_us() - start);
+    }
+
+    /* ping replies from clients */
+    memset(pkt, 0, 5);
+    pkt[0] = CMD_PING;
+    emitted = 0;
+    start = timer_now_us();
+
+    for (i = 0; i < packets; i++)
+    {
+        sim_inject(&clients[sim_rand() % n].addr, pkt, 5);
+    }
+
+    report("ping", packets, emitted, 0, timer_now_us() - start);
+
+    /* everyone goes silent, three pings each and then they time out, all of it within a tick of when it is due,
+     * the clock steps a millisecond at a time so nothing lines up with the wheel by accident */
+    emitted = 0;
+    emitted_pings = 0;
+    logged = 0;
+    late = 0;
+    relay_stats_collect();
+    probes = relay_stats.probes;
+    timing_check = 1;
+    start = timer_now_us();
+
+    {
+        uint64_t silent = sim_now;
+        int wrong = 0;
+
+        for (i = 0; i < n; i++)
+        {
+            timing[i].pings = 0;
+        }
+
+        while (relay_clients(-1) > 0 && sim_now - silent < (uint64_t)(timeout + 60) * 1000)
+        {
+            sim_now++;
+            relay_timeouts(sim_now);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            wrong += timing[i].pings != 3 || timing[i].removed != 1;
+        }
+
+        relay_stats_collect();
+
+        printf("%9d  %-10s %10.1f s %10llu %10.1f  %s, %d left, %llu late, %d off count, %llu ms wall\n", num_clients, "timeouts",
+            (sim_now - silent) / 1000.0, (unsigned long long)emitted_pings,
+            emitted_pings ? (timer_now_us() - start) * 1000.0 / emitted_pings : 0.0,
+            emitted_pings == 3ULL * n + (relay_stats.probes - probes) && logged == (uint64_t)n && late == 0 && wrong == 0 ? "ok" : "MISMATCH",
+            relay_clients(-1), (unsigned long long)late, wrong, (unsigned long long)(timer_now_us() - start) / 1000);
+    }
+
+    timing_check = 0;
+
+    relay_free();
+
+    for (g = 0; g < GAME_LAST; g++)
+    {
+        free(by_game[g]);
+    }
+
+    free(clients);
+    free(timing);
+}
+
+int main(int argc, char **argv)
+{
+    int packets = 1000000;
+    int timeout = 10;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "?hp:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                packets = atoi(optarg);
+                if (packets < 1)
+                {
+                    packets = 1;
+                }
+                break;
+            case 't':
+                timeout = atoi(optarg);
+                if (timeout < 1)
+                {
+                    timeout = 1;
+                }
+                break;
+            case 'h':
+            case '?':
+            default:
+                fprintf(stderr, "Usage: %s [-h?] [-p packets per phase] [-t timeout] [clients...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("  clients  phase         packets      emitted  ns/packet\n");
+
+    if (optind >= argc)
+    {
+        run(10, packets, timeout);
+        run(1000, packets, timeout);
+        run(10000, packets, timeout);
+        run(100000, packets, timeout);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        int n = atoi(argv[i]);
+
+        if (n >= 2)
+        {
+            run(n, packets, timeout);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "net.h"
+#include "rate.h"
+#include "relay.h"
+#include "snapshot.h"
+
+#ifndef WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+typedef struct SnapshotHeader
+{
+    char                magic[8];
+    uint32_t            capacity;
+    uint32_t            count;
+    uint64_t            saved;
+} SnapshotHeader;
+
+/* the file grows by doubling, a relay without a client limit starts with room for this many */
+#define SNAPSHOT_INITIAL    1024
+
+#ifndef WIN32
+
+static int snapshot_fd = -1;
+static SnapshotHeader *snapshot_map;
+static size_t snapshot_size;
+static uint64_t last_save;
+
+static size_t snapshot_bytes(uint32_t capacity)
+{
+    return sizeof(SnapshotHeader) + sizeof(RelaySnapshot) * capacity;
+}
+
+static RelaySnapshot *snapshot_records()
+{
+    return (RelaySnapshot *)(snapshot_map + 1);
+}
+
+static int snapshot_map_file(size_t size)
+{
+    if (snapshot_map)
+    {
+        munmap(snapshot_map, snapshot_size);
+        snapshot_map = NULL;
+    }
+
+    if (ftruncate(snapshot_fd, size) < 0)
+    {
+        return -1;
+    }
+
+    snapshot_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, snapshot_fd, 0);
+    if (snapshot_map == MAP_FAILED)
+    {
+        snapshot_map = NULL;
+        return -1;
+    }
+
+    snapshot_size = size;
+    return 0;
+}
+
+int snapshot_open(const char *path)
+{
+    struct stat st;
+
+    snapshot_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (snapshot_fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(snapshot_fd, &st) < 0)
+    {
+        snapshot_close();
+        return -1;
+    }
+
+    /* anything that isn't a snapshot of this layout starts over empty */
+    if (st.st_size >= sizeof(SnapshotHeader))
+    {
+        if (snapshot_map_file(st.st_size) < 0)
+        {
+            snapshot_close();
+            return -1;
+        }
+
+        if (memcmp(snapshot_map->magic, SNAPSHOT_MAGIC, 8) == 0
+            && snapshot_bytes(snapshot_map->capacity) <= (size_t)st.st_size
+            && snapshot_map->count <= snapshot_map->capacity)
+        {
+            return 0;
+        }
+    }
+
+    if (snapshot_map_file(snapshot_bytes(SNAPSHOT_INITIAL)) < 0)
+    {
+        snapshot_close();
+        return -1;
+    }
+
+    memset(snapshot_map, 0, sizeof(SnapshotHeader));
+    memcpy(snapshot_map->magic, SNAPSHOT_MAGIC, 8);
+    snapshot_map->capacity = SNAPSHOT_INITIAL;
+    return 0;
+}
+
+int snapshot_load(uint64_t now)
+{
+    RelaySnapshot *rec;
+    uint64_t elapsed;
+    uint32_t i;
+    int restored;
+
+    if (snapshot_map == NULL || snapshot_map->count == 0)
+    {
+        return 0;
+    }
+
+    /* idle times were taken at the save, add how long the relay was down */
+    elapsed = (uint64_t)time(NULL) > snapshot_map->saved ? ((uint64_t)time(NULL) - snapshot_map->saved) * 1000 : 0;
+    rec = snapshot_records();
+
+    for (i = 0; i < snapshot_map->count; i++)
+    {
+        rec[i].idle = rec[i].idle + elapsed < UINT32_MAX ? rec[i].idle + elapsed : UINT32_MAX;
+    }
+
+    restored = relay_restore(rec, snapshot_map->count, now);
+    last_save = now;
+    return restored;
+}
+
+void snapshot_save(uint64_t now)
+{
+    uint32_t clients, capacity;
+
+    if (snapshot_map == NULL || now - last_save < SNAPSHOT_INTERVAL)
+    {
+        return;
+    }
+
+    last_save = now;
+    clients = relay_clients(-1);
+    capacity = snapshot_map->capacity;
+
+    if (clients > capacity)
+    {
+        while (capacity < clients)
+        {
+            capacity *= 2;
+        }
+
+        if (snapshot_map_file(snapshot_bytes(capacity)) < 0)
+        {
+            return;
+        }
+
+        snapshot_map->capacity = capacity;
+    }
+
+    snapshot_map->count = relay_snapshot(snapshot_records(), capacity, now);
+    snapshot_map->saved = time(NULL);
+
+    /* survives a crash as it is, the kernel is only asked to start on the disk for a reboot */
+    msync(snapshot_map, snapshot_size, MS_ASYNC);
+}
+
+void snapshot_close()
+{
+    if (snapshot_map)
+    {
+        munmap(snapshot_map, snapshot_size);
+        snapshot_map = NULL;
+    }
+
+    if (snapshot_fd > -1)
+    {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+    }
+}
+
+#else
+
+/* no mmap, the client table is only kept in memory */
+int snapshot_open(const char *path)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int snapshot_load(uint64_t now)
+{
+    return 0;
+}
+
+void snapshot_save(uint64_t now)
+{
+}
+
+void snapshot_close()
+{
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Client table checkpointed to a memory mapped file so a crash or a reboot
+ * doesn't forget who was connected. The file is a fixed header followed by
+ * RelaySnapshot records, all in host byte order:
+ *
+ *   magic(8) capacity(4) count(4) saved(8)
+ *
+ * saved is the wall clock in seconds, the idle times of the records are
+ * relative to it. Records are written before the count so a torn checkpoint
+ * leaves a mix of old and new clients, never garbage. Include net.h and
+ * relay.h first.
+ */
+
+#define SNAPSHOT_MAGIC      "CNCSNAP\1"
+/* how often the table is written out, in milliseconds */
+#define SNAPSHOT_INTERVAL   1000
+
+int snapshot_open(const char *path);
+/* restores what was saved and hasn't timed out since, returns the number of clients */
+int snapshot_load(uint64_t now);
+void snapshot_save(uint64_t now);
+void snapshot_close();
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+    #include <windows.h>
+#endif
+
+#include "timer.h"
+
+uint64_t timer_now()
+{
+#ifdef WIN32
+    return GetTickCount();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t timer_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return count.QuadPart / (freq.QuadPart / 1000000);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void timer_init(TimerWheel *w, uint64_t now)
+{
+    memset(w, 0, sizeof(TimerWheel));
+    w->tick = now / TIMER_TICK;
+}
+
+static void timer_link(Timer **head, Timer *t)
+{
+    t->next = *head;
+    t->pprev = head;
+
+    if (*head)
+    {
+        (*head)->pprev = &t->next;
+    }
+
+    *head = t;
+}
+
+static void timer_unlink(Timer *t)
+{
+    *t->pprev = t->next;
+
+    if (t->next)
+    {
+        t->next->pprev = t->pprev;
+    }
+
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* a slot is only processed once its tick is over, so a timer goes to the first tick ending at or after it */
+void timer_add(TimerWheel *w, Timer *t, uint64_t expires)
+{
+    uint64_t tick = (expires + TIMER_TICK - 1) / TIMER_TICK;
+
+    if (t->pprev)
+    {
+        timer_unlink(t);
+        w->count--;
+    }
+
+    /* anything already due goes to the next slot to be processed */
+    if (tick < w->tick)
+    {
+        tick = w->tick;
+    }
+
+    t->expires = expires;
+    timer_link(&w->slots[tick % TIMER_SLOTS], t);
+    w->count++;
+}
+
+void timer_del(TimerWheel *w, Timer *t)
+{
+    if (t->pprev)
+    {
+        timer_unlink(t);
+        w->count--;
+    }
+}
+
+int timer_pending(Timer *t)
+{
+    return t->pprev != NULL;
+}
+
+Timer *timer_expire(TimerWheel *w, uint64_t now)
+{
+    uint64_t now_tick = now / TIMER_TICK;
+    int turns = 0;
+    Timer *t;
+
+    /* walk every slot we passed since last time, a full turn is enough to see every timer */
+    while (w->expired == NULL && w->tick <= now_tick && turns++ < TIMER_SLOTS)
+    {
+        Timer *next = w->slots[w->tick % TIMER_SLOTS];
+
+        while ((t = next))
+        {
+            next = t->next;
+
+            /* timers more than one turn away stay where they are */
+            if (t->expires <= now)
+            {
+                timer_unlink(t);
+                timer_link(&w->expired, t);
+            }
+        }
+
+        if (w->expired == NULL)
+        {
+            w->tick++;
+        }
+    }
+
+    if (w->tick <= now_tick && turns > TIMER_SLOTS)
+    {
+        w->tick = now_tick;
+    }
+
+    t = w->expired;
+
+    if (t)
+    {
+        timer_unlink(t);
+        w->count--;
+    }
+
+    return t;
+}
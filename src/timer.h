@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2012 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+/* hashed timing wheel, timers are embedded in their owners and cost O(1) to add or remove */
+
+#define TIMER_SLOTS 512
+#define TIMER_TICK  16
+
+typedef struct Timer
+{
+    struct Timer        *next;
+    struct Timer        **pprev;
+    uint64_t            expires;
+} Timer;
+
+typedef struct TimerWheel
+{
+    Timer               *slots[TIMER_SLOTS];
+    Timer               *expired;
+    uint64_t            tick;
+    uint32_t            count;
+} TimerWheel;
+
+uint64_t timer_now();
+uint64_t timer_now_us();
+
+void timer_init(TimerWheel *w, uint64_t now);
+void timer_add(TimerWheel *w, Timer *t, uint64_t expires);
+void timer_del(TimerWheel *w, Timer *t);
+int timer_pending(Timer *t);
+Timer *timer_expire(TimerWheel *w, uint64_t now);